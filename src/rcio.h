@@ -2,6 +2,8 @@
 #define _RCIO_H
 
 #include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/spinlock.h>
 
 typedef enum
 {
@@ -19,6 +21,39 @@ typedef enum
 #define EDGE_ADC_CHANNELS_COUNT 8
 #define EDGE_PWM_CHANNELS_COUNT 16
 
+/*
+ * Decoded PX4IO_PAGE_STATUS, fetched once per period by the core and
+ * shared by every subsystem through status_get().
+ */
+struct rcio_io_status
+{
+    bool valid;
+    unsigned long timestamp;
+
+    u16 freemem;
+    u16 cpuload;
+    u16 flags;
+    u16 alarms;
+    u16 vbatt;
+    u16 ibatt;
+    u16 vservo;
+    u16 vrssi;
+    u16 prssi;
+    u16 mixer;
+    u16 board_type;
+};
+
+/* one packet of a batch sent with register_transfer() */
+struct rcio_transfer
+{
+    u8 page;
+    u8 offset;
+    u16 *values;
+    u8 num_values;
+    bool write;
+    int result;
+};
+
 struct rcio_state
 {
     struct kobject *object;
@@ -28,10 +63,21 @@ struct rcio_state
     int (*register_set_byte)(struct rcio_state *state, u8 page, u8 offset, u16 value);
     u16 (*register_get_byte)(struct rcio_state *state, u8 page, u8 offset);
     int (*register_modify)(struct rcio_state *state, u8 page, u8 offset, u16 clearbits, u16 setbits);
+    int (*register_transfer)(struct rcio_state *state, struct rcio_transfer *transfers, int count);
+    bool (*status_get)(struct rcio_state *state, struct rcio_io_status *status);
     
     board_type_t board_type;
     int adc_channels_count;
     int pwm_channels_count;
+
+    /* link statistics, counted by the register helpers */
+    atomic_t transfers;
+    atomic_t transfer_errors;
+    unsigned long last_transfer_ok;
+
+    spinlock_t status_lock;
+    struct rcio_io_status io_status;
+    unsigned long status_timeout;
 };
 
 struct rcio_adapter {
@@ -41,8 +87,13 @@ struct rcio_adapter {
 
     int (*read)(struct rcio_adapter *state, u16 address, char *buffer, size_t length); 
     int (*write)(struct rcio_adapter *state, u16 address, const char *buffer, size_t length); 
+    int (*transfer)(struct rcio_adapter *state, struct rcio_transfer *transfers, int count);
 };
 
+/* real-time priority for the threads that keep time on the bus */
+struct task_struct;
+void rcio_set_fifo(struct task_struct *worker);
+
 int rcio_probe(struct rcio_adapter *state);
 int rcio_remove(struct rcio_adapter *state);
 
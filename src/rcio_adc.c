@@ -3,19 +3,106 @@
 
 #include "rcio.h"
 #include "protocol.h"
+#include "rcio_idle.h"
+#include "rcio_lazy.h"
 
 #define RCIO_ADC_MAX_CHANNELS_COUNT 8
 
+#define RCIO_ADC_MAX_OVERSAMPLING 16
+#define RCIO_ADC_MAX_AVERAGE_WINDOW 16
+#define RCIO_ADC_MAX_IIR_SHIFT 8
+#define RCIO_ADC_MAX_DECIMATION 255
+
+#define rcio_adc_err(__dev, format, args...)\
+        dev_err(__dev, "rcio_adc: " format, ##args)
+#define rcio_adc_warn(__dev, format, args...)\
+        dev_warn(__dev, "rcio_adc: " format, ##args)
+
 static struct rcio_state *rcio;
 
 static u16 measurements[RCIO_ADC_MAX_CHANNELS_COUNT];
+static u16 filtered[RCIO_ADC_MAX_CHANNELS_COUNT];
+
+typedef enum {
+    FILTER_NONE = 0, FILTER_AVERAGE, FILTER_IIR
+} filter_type_t;
+
+static const char *filter_names[] = {
+    [FILTER_NONE] = "none",
+    [FILTER_AVERAGE] = "average",
+    [FILTER_IIR] = "iir",
+};
+
+/*
+ * Optional filter stage run by the worker on every raw ADC read:
+ * oversampling raw reads are block-averaged into one filter input, which
+ * then goes through a moving average or a first-order IIR
+ * (y += (x - y) / 2^iir_shift). Every decimation-th filter output is
+ * published to filtered[]. Channels not in filter_mask pass through.
+ */
+static struct rcio_adc_filter {
+    struct mutex lock;
+    bool reset;
+
+    filter_type_t type;
+    uint16_t mask;
+    unsigned int oversampling;
+    unsigned int average_window;
+    unsigned int iir_shift;
+    unsigned int decimation;
+
+    unsigned int oversample_count;
+    unsigned int decimation_count;
+    unsigned int window_pos;
+    unsigned int window_fill;
+
+    u32 oversample_sum[RCIO_ADC_MAX_CHANNELS_COUNT];
+    u16 window[RCIO_ADC_MAX_CHANNELS_COUNT][RCIO_ADC_MAX_AVERAGE_WINDOW];
+    u32 window_sum[RCIO_ADC_MAX_CHANNELS_COUNT];
+    u32 iir_acc[RCIO_ADC_MAX_CHANNELS_COUNT];
+    bool iir_primed;
+} filter;
+
+typedef enum {
+    LEVEL_NORMAL = 0, LEVEL_HIGH, LEVEL_LOW
+} threshold_level_t;
+
+static const char *level_names[] = {
+    [LEVEL_NORMAL] = "normal",
+    [LEVEL_HIGH] = "high",
+    [LEVEL_LOW] = "low",
+};
+
+/*
+ * Per-channel threshold events. A channel goes high once it reaches
+ * rising and back to normal below rising - hysteresis; likewise it goes
+ * low at or below falling and back above falling + hysteresis. A zero
+ * threshold is disabled. Every level change is signalled with
+ * sysfs_notify() on chN_event, so userspace can block in poll().
+ */
+static struct rcio_adc_threshold {
+    u16 rising;
+    u16 falling;
+    u16 hysteresis;
+    threshold_level_t level;
+} thresholds[RCIO_ADC_MAX_CHANNELS_COUNT];
 
 bool rcio_adc_update(struct rcio_state *state);
 
+static struct rcio_lazy lazy;
+
 static ssize_t channel_show(struct kobject *kobj, struct kobj_attribute *attr,
             char *buf)
 {
     ssize_t channel = -1;
+    int ret;
+
+    rcio_idle_kick();
+
+    ret = rcio_lazy_get(&lazy);
+    if (ret < 0) {
+        return ret;
+    }
 
     if (!strcmp(attr->attr.name, "ch0")) {
         channel = measurements[0];
@@ -43,6 +130,143 @@ static ssize_t channel_show(struct kobject *kobj, struct kobj_attribute *attr,
     return sprintf(buf, "%d\n", (int)channel);
 }
 
+static ssize_t filtered_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    int channel;
+    int ret;
+
+    if (sscanf(attr->attr.name, "ch%d_filtered", &channel) != 1 || channel >= RCIO_ADC_MAX_CHANNELS_COUNT) {
+        return -EIO;
+    }
+
+    rcio_idle_kick();
+
+    ret = rcio_lazy_get(&lazy);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return sprintf(buf, "%d\n", (int)filtered[channel]);
+}
+
+static ssize_t lazy_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return rcio_lazy_attr_show(&lazy, attr->attr.name, buf);
+}
+
+static ssize_t lazy_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    return rcio_lazy_attr_store(&lazy, attr->attr.name, buf, count);
+}
+
+static ssize_t filter_type_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%s\n", filter_names[filter.type]);
+}
+
+static ssize_t filter_type_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    for (int i = 0; i < ARRAY_SIZE(filter_names); i++) {
+        if (sysfs_streq(buf, filter_names[i])) {
+            mutex_lock(&filter.lock);
+            filter.type = i;
+            filter.reset = true;
+            mutex_unlock(&filter.lock);
+            return count;
+        }
+    }
+
+    rcio_adc_err(rcio->adapter->dev, "Invalid value for filter_type, this should be none, average or iir\n");
+    return -EINVAL;
+}
+
+static ssize_t filter_mask_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "0x%x\n", filter.mask);
+}
+
+static ssize_t filter_mask_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    uint16_t max_mask = (uint16_t)((1U << rcio->adc_channels_count) - 1U);
+    unsigned long mask;
+
+    if (kstrtoul(buf, 16, &mask) < 0 || mask > max_mask) {
+        rcio_adc_err(rcio->adapter->dev, "Invalid value for filter_mask, this should be from 0x0 to 0x%x\n", max_mask);
+        return -EINVAL;
+    }
+
+    mutex_lock(&filter.lock);
+    filter.mask = mask;
+    filter.reset = true;
+    mutex_unlock(&filter.lock);
+
+    return count;
+}
+
+static ssize_t event_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    int channel;
+
+    if (sscanf(attr->attr.name, "ch%d_event", &channel) != 1 || channel >= RCIO_ADC_MAX_CHANNELS_COUNT) {
+        return -EIO;
+    }
+
+    return sprintf(buf, "%s\n", level_names[READ_ONCE(thresholds[channel].level)]);
+}
+
+static u16 *threshold_param(struct kobj_attribute *attr)
+{
+    int channel;
+    char param[16];
+
+    if (sscanf(attr->attr.name, "ch%d_%15s", &channel, param) != 2 || channel >= RCIO_ADC_MAX_CHANNELS_COUNT) {
+        return NULL;
+    }
+
+    if (!strcmp(param, "rising")) {
+        return &thresholds[channel].rising;
+    } else if (!strcmp(param, "falling")) {
+        return &thresholds[channel].falling;
+    } else if (!strcmp(param, "hysteresis")) {
+        return &thresholds[channel].hysteresis;
+    }
+
+    return NULL;
+}
+
+static ssize_t threshold_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    u16 *param = threshold_param(attr);
+
+    if (param == NULL) {
+        return -EIO;
+    }
+
+    return sprintf(buf, "%u\n", READ_ONCE(*param));
+}
+
+static ssize_t threshold_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    u16 value;
+    u16 *param = threshold_param(attr);
+
+    if (param == NULL) {
+        return -EIO;
+    }
+
+    if (kstrtou16(buf, 10, &value) < 0) {
+        rcio_adc_err(rcio->adapter->dev, "Invalid value for %s\n", attr->attr.name);
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(*param, value);
+
+    return count;
+}
+
+static ssize_t filter_param_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t filter_param_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count);
+
 static struct kobj_attribute ch0_attribute = __ATTR(ch0, S_IRUGO, channel_show, NULL);
 static struct kobj_attribute ch1_attribute = __ATTR(ch1, S_IRUGO, channel_show, NULL);
 static struct kobj_attribute ch2_attribute = __ATTR(ch2, S_IRUGO, channel_show, NULL);
@@ -52,6 +276,120 @@ static struct kobj_attribute ch5_attribute = __ATTR(ch5, S_IRUGO, channel_show,
 static struct kobj_attribute ch6_attribute = __ATTR(ch6, S_IRUGO, channel_show, NULL);
 static struct kobj_attribute ch7_attribute = __ATTR(ch7, S_IRUGO, channel_show, NULL);
 
+static struct kobj_attribute policy_attribute = __ATTR(policy, S_IRUGO | S_IWUSR, lazy_show, lazy_store);
+static struct kobj_attribute max_age_ms_attribute = __ATTR(max_age_ms, S_IRUGO | S_IWUSR, lazy_show, lazy_store);
+static struct kobj_attribute lazy_poll_ms_attribute = __ATTR(lazy_poll_ms, S_IRUGO | S_IWUSR, lazy_show, lazy_store);
+static struct kobj_attribute refreshes_attribute = __ATTR(refreshes, S_IRUGO, lazy_show, NULL);
+
+#define ADC_FILTERED_ATTR(channel) __ATTR(channel##_filtered, S_IRUGO, filtered_show, NULL)
+
+static struct kobj_attribute ch0_filtered_attribute = ADC_FILTERED_ATTR(ch0);
+static struct kobj_attribute ch1_filtered_attribute = ADC_FILTERED_ATTR(ch1);
+static struct kobj_attribute ch2_filtered_attribute = ADC_FILTERED_ATTR(ch2);
+static struct kobj_attribute ch3_filtered_attribute = ADC_FILTERED_ATTR(ch3);
+static struct kobj_attribute ch4_filtered_attribute = ADC_FILTERED_ATTR(ch4);
+static struct kobj_attribute ch5_filtered_attribute = ADC_FILTERED_ATTR(ch5);
+static struct kobj_attribute ch6_filtered_attribute = ADC_FILTERED_ATTR(ch6);
+static struct kobj_attribute ch7_filtered_attribute = ADC_FILTERED_ATTR(ch7);
+
+#define ADC_THRESHOLD_ATTR(param) __ATTR(param, S_IRUGO | S_IWUSR, threshold_show, threshold_store)
+#define ADC_EVENT_ATTR(channel) __ATTR(channel##_event, S_IRUGO, event_show, NULL)
+
+#define ADC_THRESHOLD_ATTRS(channel) \
+static struct kobj_attribute channel##_rising_attribute = ADC_THRESHOLD_ATTR(channel##_rising); \
+static struct kobj_attribute channel##_falling_attribute = ADC_THRESHOLD_ATTR(channel##_falling); \
+static struct kobj_attribute channel##_hysteresis_attribute = ADC_THRESHOLD_ATTR(channel##_hysteresis); \
+static struct kobj_attribute channel##_event_attribute = ADC_EVENT_ATTR(channel)
+
+ADC_THRESHOLD_ATTRS(ch0);
+ADC_THRESHOLD_ATTRS(ch1);
+ADC_THRESHOLD_ATTRS(ch2);
+ADC_THRESHOLD_ATTRS(ch3);
+ADC_THRESHOLD_ATTRS(ch4);
+ADC_THRESHOLD_ATTRS(ch5);
+ADC_THRESHOLD_ATTRS(ch6);
+ADC_THRESHOLD_ATTRS(ch7);
+
+static struct kobj_attribute *event_attributes[RCIO_ADC_MAX_CHANNELS_COUNT] = {
+    &ch0_event_attribute,
+    &ch1_event_attribute,
+    &ch2_event_attribute,
+    &ch3_event_attribute,
+    &ch4_event_attribute,
+    &ch5_event_attribute,
+    &ch6_event_attribute,
+    &ch7_event_attribute,
+};
+
+#define ADC_FILTER_PARAM_ATTR(param) __ATTR(param, S_IRUGO | S_IWUSR, filter_param_show, filter_param_store)
+
+static struct kobj_attribute filter_type_attribute = __ATTR_RW(filter_type);
+static struct kobj_attribute filter_mask_attribute = __ATTR_RW(filter_mask);
+static struct kobj_attribute oversampling_attribute = ADC_FILTER_PARAM_ATTR(oversampling);
+static struct kobj_attribute average_window_attribute = ADC_FILTER_PARAM_ATTR(average_window);
+static struct kobj_attribute iir_shift_attribute = ADC_FILTER_PARAM_ATTR(iir_shift);
+static struct kobj_attribute decimation_attribute = ADC_FILTER_PARAM_ATTR(decimation);
+
+static unsigned int *filter_param(struct kobj_attribute *attr, unsigned int *max_value)
+{
+    if (attr == &oversampling_attribute) {
+        *max_value = RCIO_ADC_MAX_OVERSAMPLING;
+        return &filter.oversampling;
+    } else if (attr == &average_window_attribute) {
+        *max_value = RCIO_ADC_MAX_AVERAGE_WINDOW;
+        return &filter.average_window;
+    } else if (attr == &iir_shift_attribute) {
+        *max_value = RCIO_ADC_MAX_IIR_SHIFT;
+        return &filter.iir_shift;
+    } else if (attr == &decimation_attribute) {
+        *max_value = RCIO_ADC_MAX_DECIMATION;
+        return &filter.decimation;
+    }
+
+    return NULL;
+}
+
+static ssize_t filter_param_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    unsigned int max_value;
+    unsigned int *param = filter_param(attr, &max_value);
+
+    if (param == NULL) {
+        return -EIO;
+    }
+
+    return sprintf(buf, "%u\n", *param);
+}
+
+static ssize_t filter_param_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int max_value;
+    unsigned int value;
+    unsigned int *param = filter_param(attr, &max_value);
+
+    if (param == NULL) {
+        return -EIO;
+    }
+
+    if (kstrtouint(buf, 10, &value) < 0 || value < 1 || value > max_value) {
+        rcio_adc_err(rcio->adapter->dev, "Invalid value for %s, this should be from 1 to %u\n", attr->attr.name, max_value);
+        return -EINVAL;
+    }
+
+    mutex_lock(&filter.lock);
+    *param = value;
+    filter.reset = true;
+    mutex_unlock(&filter.lock);
+
+    return count;
+}
+
+#define ADC_THRESHOLD_ATTRS_LIST(channel) \
+    &channel##_rising_attribute.attr, \
+    &channel##_falling_attribute.attr, \
+    &channel##_hysteresis_attribute.attr, \
+    &channel##_event_attribute.attr
+
 static struct attribute *attrs[] = {
     &ch0_attribute.attr,
     &ch1_attribute.attr,
@@ -61,30 +399,208 @@ static struct attribute *attrs[] = {
     &ch5_attribute.attr,
     &ch6_attribute.attr,
     &ch7_attribute.attr,
+    &ch0_filtered_attribute.attr,
+    &ch1_filtered_attribute.attr,
+    &ch2_filtered_attribute.attr,
+    &ch3_filtered_attribute.attr,
+    &ch4_filtered_attribute.attr,
+    &ch5_filtered_attribute.attr,
+    &ch6_filtered_attribute.attr,
+    &ch7_filtered_attribute.attr,
+    ADC_THRESHOLD_ATTRS_LIST(ch0),
+    ADC_THRESHOLD_ATTRS_LIST(ch1),
+    ADC_THRESHOLD_ATTRS_LIST(ch2),
+    ADC_THRESHOLD_ATTRS_LIST(ch3),
+    ADC_THRESHOLD_ATTRS_LIST(ch4),
+    ADC_THRESHOLD_ATTRS_LIST(ch5),
+    ADC_THRESHOLD_ATTRS_LIST(ch6),
+    ADC_THRESHOLD_ATTRS_LIST(ch7),
+    &filter_type_attribute.attr,
+    &filter_mask_attribute.attr,
+    &oversampling_attribute.attr,
+    &average_window_attribute.attr,
+    &iir_shift_attribute.attr,
+    &decimation_attribute.attr,
+    &policy_attribute.attr,
+    &max_age_ms_attribute.attr,
+    &lazy_poll_ms_attribute.attr,
+    &refreshes_attribute.attr,
     NULL,
 };
 
+static umode_t attr_is_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+    int channel;
+
+    //switching off channels we dont use
+    if (sscanf(attr->name, "ch%d", &channel) == 1 && channel >= rcio->adc_channels_count) {
+        return 0;
+    }
+
+    return attr->mode;
+}
+
 static struct attribute_group attr_group = {
     .name = "adc",
     .attrs = attrs,
+    .is_visible = attr_is_visible,
 };
 
 static unsigned long timeout;
 
-bool rcio_adc_update(struct rcio_state *state)
+static void rcio_adc_filter_reset(void)
 {
-    if (time_before(jiffies, timeout)) {
-        return false;
+    filter.oversample_count = 0;
+    filter.decimation_count = 0;
+    filter.window_pos = 0;
+    filter.window_fill = 0;
+    filter.iir_primed = false;
+
+    memset(filter.oversample_sum, 0, sizeof(filter.oversample_sum));
+    memset(filter.window_sum, 0, sizeof(filter.window_sum));
+
+    for (int i = 0; i < RCIO_ADC_MAX_CHANNELS_COUNT; i++) {
+        filtered[i] = measurements[i];
+    }
+
+    filter.reset = false;
+}
+
+static u16 rcio_adc_filter_sample(int channel, u16 sample)
+{
+    u16 *slot;
+
+    switch (filter.type) {
+    case FILTER_AVERAGE:
+        slot = &filter.window[channel][filter.window_pos];
+        if (filter.window_fill == filter.average_window) {
+            filter.window_sum[channel] -= *slot;
+        }
+        *slot = sample;
+        filter.window_sum[channel] += sample;
+        return filter.window_sum[channel] / min(filter.window_fill + 1, filter.average_window);
+
+    case FILTER_IIR:
+        /* accumulator holds the output scaled by 2^iir_shift */
+        if (!filter.iir_primed) {
+            filter.iir_acc[channel] = (u32)sample << filter.iir_shift;
+        } else {
+            /* y += (x - y) / 2^k, with acc = y * 2^k */
+            filter.iir_acc[channel] = filter.iir_acc[channel] - (filter.iir_acc[channel] >> filter.iir_shift) + sample;
+        }
+        return filter.iir_acc[channel] >> filter.iir_shift;
+
+    case FILTER_NONE:
+    default:
+        return sample;
+    }
+}
+
+static void rcio_adc_filter_update(void)
+{
+    u16 output[RCIO_ADC_MAX_CHANNELS_COUNT];
+    bool publish;
+
+    mutex_lock(&filter.lock);
+
+    if (filter.reset) {
+        rcio_adc_filter_reset();
+    }
+
+    for (int i = 0; i < RCIO_ADC_MAX_CHANNELS_COUNT; i++) {
+        filter.oversample_sum[i] += measurements[i];
+    }
+
+    if (++filter.oversample_count < filter.oversampling) {
+        mutex_unlock(&filter.lock);
+        return;
+    }
+
+    for (int i = 0; i < RCIO_ADC_MAX_CHANNELS_COUNT; i++) {
+        u16 sample = filter.oversample_sum[i] / filter.oversampling;
+
+        filter.oversample_sum[i] = 0;
+        output[i] = (filter.mask & (1 << i)) ? rcio_adc_filter_sample(i, sample) : measurements[i];
+    }
+
+    filter.oversample_count = 0;
+    filter.iir_primed = true;
+    filter.window_pos = (filter.window_pos + 1) % filter.average_window;
+    if (filter.window_fill < filter.average_window) {
+        filter.window_fill++;
+    }
+
+    publish = (++filter.decimation_count >= filter.decimation);
+    if (publish) {
+        filter.decimation_count = 0;
+        memcpy(filtered, output, sizeof(filtered));
+    }
+
+    mutex_unlock(&filter.lock);
+}
+
+static threshold_level_t rcio_adc_threshold_level(struct rcio_adc_threshold *threshold, u16 value)
+{
+    u16 rising = READ_ONCE(threshold->rising);
+    u16 falling = READ_ONCE(threshold->falling);
+    u16 hysteresis = READ_ONCE(threshold->hysteresis);
+
+    if (rising && value >= rising) {
+        return LEVEL_HIGH;
+    }
+
+    if (falling && value <= falling) {
+        return LEVEL_LOW;
+    }
+
+    /* inside the hysteresis band the previous level is kept */
+    if (threshold->level == LEVEL_HIGH && rising && (u32)value + hysteresis >= rising) {
+        return LEVEL_HIGH;
     }
 
+    if (threshold->level == LEVEL_LOW && falling && value <= (u32)falling + hysteresis) {
+        return LEVEL_LOW;
+    }
+
+    return LEVEL_NORMAL;
+}
+
+static void rcio_adc_check_thresholds(struct rcio_state *state)
+{
+    for (int i = 0; i < state->adc_channels_count; i++) {
+        threshold_level_t level = rcio_adc_threshold_level(&thresholds[i], filtered[i]);
+
+        if (level != thresholds[i].level) {
+            WRITE_ONCE(thresholds[i].level, level);
+            sysfs_notify(state->object, attr_group.name, event_attributes[i]->attr.name);
+        }
+    }
+}
+
+/* threshold events follow the refreshes, so a stopped background poll only reports them on reads */
+static bool rcio_adc_refresh(struct rcio_state *state)
+{
     if (state->register_get(state, PX4IO_PAGE_RAW_ADC_INPUT, 0, measurements, RCIO_ADC_MAX_CHANNELS_COUNT) < 0) {
         return false;
     }
 
-    timeout = jiffies + HZ / 50; /* timeout in 0.02s */
+    rcio_adc_filter_update();
+    rcio_adc_check_thresholds(state);
+
     return true;
 }
 
+bool rcio_adc_update(struct rcio_state *state)
+{
+    return rcio_lazy_poll(&lazy, &timeout, HZ / 50); /* timeout in 0.02s */
+}
+
+
+void rcio_adc_read(u16 *raw, u16 *filtered_values)
+{
+    memcpy(raw, measurements, sizeof(measurements));
+    memcpy(filtered_values, filtered, sizeof(filtered));
+}
 
 int rcio_adc_probe(struct rcio_state *state)
 {
@@ -93,9 +609,17 @@ int rcio_adc_probe(struct rcio_state *state)
     rcio = state;
 
     timeout = jiffies + HZ / 50; /* timeout in 0.02s */
-    
-    //switching off channels we dont use
-    attrs[state->adc_channels_count] = NULL;
+
+    mutex_init(&filter.lock);
+    filter.type = FILTER_NONE;
+    filter.mask = 0;
+    filter.oversampling = 1;
+    filter.average_window = 4;
+    filter.iir_shift = 3;
+    filter.decimation = 1;
+    filter.reset = true;
+
+    rcio_lazy_init(&lazy, state, rcio_adc_refresh, 100);
 
     ret = sysfs_create_group(rcio->object, &attr_group);
 
@@ -108,6 +632,7 @@ int rcio_adc_probe(struct rcio_state *state)
 
 EXPORT_SYMBOL_GPL(rcio_adc_probe);
 EXPORT_SYMBOL_GPL(rcio_adc_update);
+EXPORT_SYMBOL_GPL(rcio_adc_read);
 MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
 MODULE_DESCRIPTION("RCIO ADC driver");
 MODULE_LICENSE("GPL v2");
@@ -5,5 +5,6 @@
 
 int rcio_adc_probe(struct rcio_state* state);
 bool rcio_adc_update(struct rcio_state *state);
+void rcio_adc_read(u16 *raw, u16 *filtered);
 
 #endif
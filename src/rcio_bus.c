@@ -0,0 +1,199 @@
+#include <linux/module.h>
+#include <linux/rtmutex.h>
+#include <linux/ktime.h>
+#define DEBUG
+#include <linux/device.h>
+
+#include "rcio.h"
+#include "protocol.h"
+#include "rcio_bus.h"
+
+#define rcio_bus_err(__dev, format, args...)\
+        dev_err(__dev, "rcio_bus: " format, ##args)
+
+static const char *bus_class_names[RCIO_BUS_CLASSES] = {
+    [RCIO_BUS_ACTUATOR] = "actuator",
+    [RCIO_BUS_RC] = "rc",
+    [RCIO_BUS_TELEMETRY] = "telemetry",
+    [RCIO_BUS_CONFIG] = "config",
+};
+
+struct rcio_bus_stats {
+    u64 count;
+    u64 total_wait_ns;
+    u64 max_wait_ns;
+};
+
+/*
+ * Every register access goes through here before it reaches the adapter.
+ * The bus is handed out one packet at a time, so a multi-packet sysfs
+ * operation can be overtaken between its packets. A class does not go
+ * for the bus while a more important one is waiting for it, and the bus
+ * itself is an rt_mutex so an RT caller boosts whoever holds it for the
+ * one packet it has to wait for.
+ */
+static struct rcio_bus {
+    struct rcio_state *rcio;
+    struct rt_mutex lock;
+    wait_queue_head_t wait;
+    atomic_t waiting[RCIO_BUS_CLASSES];
+
+    spinlock_t stats_lock;
+    struct rcio_bus_stats stats[RCIO_BUS_CLASSES];
+} bus;
+
+rcio_bus_class_t rcio_bus_classify(u8 page, bool write)
+{
+    if (write) {
+        switch (page) {
+        case PX4IO_PAGE_DIRECT_PWM:
+        case PX4IO_PAGE_RCIO_HEARTBEAT:
+        case PX4IO_PAGE_GPIO:
+            return RCIO_BUS_ACTUATOR;
+        default:
+            return RCIO_BUS_CONFIG;
+        }
+    }
+
+    switch (page) {
+    case PX4IO_PAGE_STATUS:
+    case PX4IO_PAGE_RAW_RC_INPUT:
+    case PX4IO_PAGE_RC_INPUT:
+        return RCIO_BUS_RC;
+    case PX4IO_PAGE_RAW_ADC_INPUT:
+    case PX4IO_PAGE_GPIO:
+    case PX4IO_PAGE_DIRECT_PWM:
+    case PX4IO_PAGE_PWM_INFO:
+        return RCIO_BUS_TELEMETRY;
+    default:
+        return RCIO_BUS_CONFIG;
+    }
+}
+
+const char *rcio_bus_class_name(rcio_bus_class_t class)
+{
+    return bus_class_names[class];
+}
+
+static bool rcio_bus_higher_waiting(rcio_bus_class_t class)
+{
+    for (int i = 0; i < class; i++) {
+        if (atomic_read(&bus.waiting[i]) > 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void rcio_bus_acquire(rcio_bus_class_t class)
+{
+    u64 start = ktime_get_ns();
+    u64 waited;
+
+    atomic_inc(&bus.waiting[class]);
+
+    for (;;) {
+        wait_event(bus.wait, !rcio_bus_higher_waiting(class));
+
+        rt_mutex_lock(&bus.lock);
+
+        /* somebody more important queued up while we were blocked on the lock */
+        if (!rcio_bus_higher_waiting(class)) {
+            break;
+        }
+
+        rt_mutex_unlock(&bus.lock);
+    }
+
+    atomic_dec(&bus.waiting[class]);
+    wake_up_all(&bus.wait);
+
+    waited = ktime_get_ns() - start;
+
+    spin_lock(&bus.stats_lock);
+    bus.stats[class].count++;
+    bus.stats[class].total_wait_ns += waited;
+    bus.stats[class].max_wait_ns = max(bus.stats[class].max_wait_ns, waited);
+    spin_unlock(&bus.stats_lock);
+}
+
+void rcio_bus_release(rcio_bus_class_t class)
+{
+    rt_mutex_unlock(&bus.lock);
+}
+
+static ssize_t stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct rcio_bus_stats stats[RCIO_BUS_CLASSES];
+    ssize_t len;
+
+    spin_lock(&bus.stats_lock);
+    memcpy(stats, bus.stats, sizeof(stats));
+    spin_unlock(&bus.stats_lock);
+
+    len = scnprintf(buf, PAGE_SIZE, "class count avg_wait_us max_wait_us\n");
+
+    for (int i = 0; i < RCIO_BUS_CLASSES; i++) {
+        u64 avg = stats[i].count ? div64_u64(stats[i].total_wait_ns, stats[i].count) : 0;
+
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s %llu %llu %llu\n", bus_class_names[i], stats[i].count,
+                div_u64(avg, NSEC_PER_USEC), div_u64(stats[i].max_wait_ns, NSEC_PER_USEC));
+    }
+
+    return len;
+}
+
+static ssize_t stats_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    spin_lock(&bus.stats_lock);
+    memset(bus.stats, 0, sizeof(bus.stats));
+    spin_unlock(&bus.stats_lock);
+
+    return count;
+}
+
+static struct kobj_attribute stats_attribute = __ATTR_RW(stats);
+
+static struct attribute *attrs[] = {
+    &stats_attribute.attr,
+    NULL,
+};
+
+static struct attribute_group attr_group = {
+    .name = "bus",
+    .attrs = attrs,
+};
+
+int rcio_bus_probe(struct rcio_state *state)
+{
+    int ret;
+
+    bus.rcio = state;
+
+    rt_mutex_init(&bus.lock);
+    init_waitqueue_head(&bus.wait);
+    spin_lock_init(&bus.stats_lock);
+
+    for (int i = 0; i < RCIO_BUS_CLASSES; i++) {
+        atomic_set(&bus.waiting[i], 0);
+    }
+
+    ret = sysfs_create_group(bus.rcio->object, &attr_group);
+
+    if (ret < 0) {
+        rcio_bus_err(state->adapter->dev, "module not registered int sysfs\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+EXPORT_SYMBOL_GPL(rcio_bus_probe);
+EXPORT_SYMBOL_GPL(rcio_bus_classify);
+EXPORT_SYMBOL_GPL(rcio_bus_class_name);
+EXPORT_SYMBOL_GPL(rcio_bus_acquire);
+EXPORT_SYMBOL_GPL(rcio_bus_release);
+MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
+MODULE_DESCRIPTION("RCIO bus arbiter");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,18 @@
+#ifndef _RCIO_BUS_H
+#define _RCIO_BUS_H
+
+#include "rcio.h"
+
+/* in order of priority, lower goes first */
+typedef enum {
+    RCIO_BUS_ACTUATOR = 0, RCIO_BUS_RC, RCIO_BUS_TELEMETRY, RCIO_BUS_CONFIG,
+    RCIO_BUS_CLASSES
+} rcio_bus_class_t;
+
+int rcio_bus_probe(struct rcio_state *state);
+rcio_bus_class_t rcio_bus_classify(u8 page, bool write);
+const char *rcio_bus_class_name(rcio_bus_class_t class);
+void rcio_bus_acquire(rcio_bus_class_t class);
+void rcio_bus_release(rcio_bus_class_t class);
+
+#endif
@@ -6,43 +6,134 @@
 #include <linux/delay.h>
 #include <linux/sched.h>
 #include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
 
 #include "rcio.h"
+#include "protocol.h"
+#include "rcio_bus.h"
 #include "rcio_adc.h"
 #include "rcio_pwm.h"
 #include "rcio_rcin.h"
 #include "rcio_status.h"
 #include "rcio_safety.h"
 #include "rcio_gpio.h"
+#include "rcio_health.h"
+#include "rcio_link.h"
+#include "rcio_telemetry.h"
+#include "rcio_idle.h"
+#include "rcio_debug.h"
+#include "rcio_stats.h"
+#include "rcio_lazy.h"
+
+#define CREATE_TRACE_POINTS
+#include "rcio_trace.h"
+
+static void register_account(struct rcio_state *state, int ret)
+{
+    atomic_inc(&state->transfers);
 
-static int register_set(struct rcio_state *state, u8 page, u8 offset, const u16 *values, u8 num_values)
+    if (ret < 0) {
+        atomic_inc(&state->transfer_errors);
+    } else {
+        WRITE_ONCE(state->last_transfer_ok, jiffies);
+    }
+}
+
+/* caller is the call site outside the core, so the lock profile can tell subsystems apart */
+static int __register_set(struct rcio_state *state, u8 page, u8 offset, const u16 *values, u8 num_values,
+        unsigned long caller)
 {
+    rcio_bus_class_t class = rcio_bus_classify(page, true);
+    u64 start, acquired, done;
     int ret;
 
+    start = ktime_get_ns();
+    rcio_bus_acquire(class);
+    acquired = ktime_get_ns();
     ret = state->adapter->write(state->adapter, (page << 8) | offset, (void *)values, num_values);
+    rcio_bus_release(class);
+    done = ktime_get_ns();
+    register_account(state, ret);
+
+    rcio_debug_transfer(page, true, num_values, ret, acquired - start, done - acquired);
+    rcio_debug_lock(caller, acquired - start, done - acquired);
+    trace_rcio_register(page, offset, num_values, true, class, acquired - start, done - acquired, ret);
 
     return ret;
 }
 
-static int register_get(struct rcio_state *state, u8 page, u8 offset, u16 *values, u8 num_values)
+static int __register_get(struct rcio_state *state, u8 page, u8 offset, u16 *values, u8 num_values,
+        unsigned long caller)
 {
+    rcio_bus_class_t class = rcio_bus_classify(page, false);
+    u64 start, acquired, done;
     int ret;
 
+    start = ktime_get_ns();
+    rcio_bus_acquire(class);
+    acquired = ktime_get_ns();
     ret = state->adapter->read(state->adapter, (page << 8) | offset, (void *)values, num_values);
+    rcio_bus_release(class);
+    done = ktime_get_ns();
+    register_account(state, ret);
+
+    rcio_debug_transfer(page, false, num_values, ret, acquired - start, done - acquired);
+    rcio_debug_lock(caller, acquired - start, done - acquired);
+    trace_rcio_register(page, offset, num_values, false, class, acquired - start, done - acquired, ret);
 
     return ret;
 }
 
+/* a batch holds the bus throughout and goes at the priority of its first packet */
+static int register_transfer(struct rcio_state *state, struct rcio_transfer *transfers, int count)
+{
+    rcio_bus_class_t class = rcio_bus_classify(transfers[0].page, transfers[0].write);
+    u64 start, acquired, done;
+    int ret;
+
+    start = ktime_get_ns();
+    rcio_bus_acquire(class);
+    acquired = ktime_get_ns();
+    ret = state->adapter->transfer(state->adapter, transfers, count);
+    rcio_bus_release(class);
+    done = ktime_get_ns();
+
+    rcio_debug_lock(_RET_IP_, acquired - start, done - acquired);
+
+    for (int i = 0; i < count; i++) {
+        register_account(state, transfers[i].result);
+
+        /* the batch timing goes with its first packet */
+        rcio_debug_transfer(transfers[i].page, transfers[i].write, transfers[i].num_values, transfers[i].result,
+                i ? 0 : acquired - start, i ? 0 : done - acquired);
+        trace_rcio_register(transfers[i].page, transfers[i].offset, transfers[i].num_values, transfers[i].write, class,
+                i ? 0 : acquired - start, i ? 0 : done - acquired, transfers[i].result);
+    }
+
+    return ret;
+}
+
+static int register_set(struct rcio_state *state, u8 page, u8 offset, const u16 *values, u8 num_values)
+{
+    return __register_set(state, page, offset, values, num_values, _RET_IP_);
+}
+
+static int register_get(struct rcio_state *state, u8 page, u8 offset, u16 *values, u8 num_values)
+{
+    return __register_get(state, page, offset, values, num_values, _RET_IP_);
+}
+
 static int register_set_byte(struct rcio_state *state, u8 page, u8 offset, u16 value)
 {
-    return register_set(state, page, offset, &value, 1);
+    return __register_set(state, page, offset, &value, 1, _RET_IP_);
 }
 
 static u16 register_get_byte(struct rcio_state *state, u8 page, u8 offset)
 {
     u16 reg;
     
-    register_get(state, page, offset, &reg, 1);
+    __register_get(state, page, offset, &reg, 1, _RET_IP_);
 
     return reg;
 }
@@ -52,7 +143,7 @@ static int register_modify(struct rcio_state *state, u8 page, u8 offset, u16 cle
     int ret;
     u16 value;
 
-    ret = register_get(state, page, offset, &value, 1);
+    ret = __register_get(state, page, offset, &value, 1, _RET_IP_);
 
     if (ret < 0)
         return ret;
@@ -60,41 +151,247 @@ static int register_modify(struct rcio_state *state, u8 page, u8 offset, u16 cle
     value &= ~clearbits;
     value |= setbits;
 
-    return register_set_byte(state, page, offset, value);
+    return __register_set(state, page, offset, &value, 1, _RET_IP_);
+}
+
+static bool status_get(struct rcio_state *state, struct rcio_io_status *status)
+{
+    spin_lock(&state->status_lock);
+    *status = state->io_status;
+    spin_unlock(&state->status_lock);
+
+    return status->valid;
 }
 
+/* one read of the whole status page serves rcin, status and the rest */
+static bool status_fetch(struct rcio_state *state)
+{
+    u16 regs[PX4IO_P_STATUS_BOARD_TYPE + 1];
+    bool valid;
+
+    if (time_before(jiffies, state->status_timeout)) {
+        return false;
+    }
+
+    state->status_timeout = jiffies + HZ / 100; /* timeout in 0.01s */
+
+    valid = state->register_get(state, PX4IO_PAGE_STATUS, PX4IO_P_STATUS_FREEMEM, regs, ARRAY_SIZE(regs)) >= 0;
+
+    spin_lock(&state->status_lock);
+
+    state->io_status.valid = valid;
+
+    if (valid) {
+        state->io_status.timestamp = jiffies;
+        state->io_status.freemem = regs[PX4IO_P_STATUS_FREEMEM];
+        state->io_status.cpuload = regs[PX4IO_P_STATUS_CPULOAD];
+        state->io_status.flags = regs[PX4IO_P_STATUS_FLAGS];
+        state->io_status.alarms = regs[PX4IO_P_STATUS_ALARMS];
+        state->io_status.vbatt = regs[PX4IO_P_STATUS_VBATT];
+        state->io_status.ibatt = regs[PX4IO_P_STATUS_IBATT];
+        state->io_status.vservo = regs[PX4IO_P_STATUS_VSERVO];
+        state->io_status.vrssi = regs[PX4IO_P_STATUS_VRSSI];
+        state->io_status.prssi = regs[PX4IO_P_STATUS_PRSSI];
+        state->io_status.mixer = regs[PX4IO_P_STATUS_MIXER];
+        state->io_status.board_type = regs[PX4IO_P_STATUS_BOARD_TYPE];
+    }
+
+    spin_unlock(&state->status_lock);
+
+    return valid;
+}
+
+static int fast_cpu = -1;
+module_param(fast_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(fast_cpu, "CPU to pin the PWM/RC loop to, -1 to let the scheduler pick");
+
+static int slow_cpu = -1;
+module_param(slow_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(slow_cpu, "CPU to pin the ADC/status/GPIO loop to, -1 to let the scheduler pick");
+
+static bool fast_rt = true;
+module_param(fast_rt, bool, S_IRUGO);
+MODULE_PARM_DESC(fast_rt, "Run the PWM/RC loop as a SCHED_FIFO thread");
+
+static int slow_nice = 0;
+module_param(slow_nice, int, S_IRUGO);
+MODULE_PARM_DESC(slow_nice, "Nice value of the ADC/status/GPIO loop");
+
 static struct rcio_state rcio_state;
 
-struct task_struct *task;
+static struct task_struct *fast_task;
+static struct task_struct *slow_task;
+
+/* what each loop is updating right now, so the debugfs counters can charge transfers to it */
+static rcio_subsystem_t fast_subsystem = RCIO_SUBSYSTEMS;
+static rcio_subsystem_t slow_subsystem = RCIO_SUBSYSTEMS;
 
-int worker(void *data)
+static rcio_subsystem_t *rcio_updating(void)
+{
+    if (current == READ_ONCE(fast_task)) {
+        return &fast_subsystem;
+    }
+
+    if (current == READ_ONCE(slow_task)) {
+        return &slow_subsystem;
+    }
+
+    return NULL;
+}
+
+/* sysfs, probe and anything else outside the loops is RCIO_SUBSYSTEMS */
+rcio_subsystem_t rcio_current_subsystem(void)
+{
+    rcio_subsystem_t *updating = rcio_updating();
+
+    return updating ? *updating : RCIO_SUBSYSTEMS;
+}
+
+#define rcio_timed_update(subsystem, call) ({ \
+    bool __updated; \
+    rcio_subsystem_t *__updating = rcio_updating(); \
+    u64 __start = ktime_get_ns(); \
+    if (__updating) *__updating = (subsystem); \
+    trace_rcio_update_enter(rcio_stats_subsystem_name(subsystem)); \
+    __updated = (call); \
+    trace_rcio_update_exit(rcio_stats_subsystem_name(subsystem), __updated); \
+    if (__updating) *__updating = RCIO_SUBSYSTEMS; \
+    rcio_stats_subsystem(subsystem, ktime_get_ns() - __start); \
+    __updated; \
+})
+
+static bool link_up = true;
+
+/*
+ * Everything on the path from a PWM value to the IO runs here, nothing in
+ * this loop may wait for the slow one. Both loops share the bus through
+ * the arbiter, so slow reads can only delay a frame by a single packet.
+ */
+static int fast_worker(void *data)
 {
     struct rcio_state *state = (struct rcio_state *) data;
-    int fail_counter = 0;
-    bool pwm_updated = false;
-    bool adc_updated = false;
     bool rcin_updated = false;
 
-    bool gpio_updated = false;
+    while (!kthread_should_stop()) {
+        trace_rcio_cycle_start("fast");
+        rcio_stats_cycle_start(RCIO_LOOP_FAST);
+
+        rcio_idle_update(state);
+
+        /* RC flags and IO reset detection come from the status page */
+        rcio_timed_update(RCIO_SUBSYSTEM_STATUS_FETCH, status_fetch(state));
+
+        /* while the IO is lost only the status page and the supervisor run */
+        WRITE_ONCE(link_up, rcio_timed_update(RCIO_SUBSYSTEM_LINK, rcio_link_update(state)));
+
+        if (link_up) {
+            rcio_timed_update(RCIO_SUBSYSTEM_PWM, rcio_pwm_update(state));
+            rcin_updated = rcio_timed_update(RCIO_SUBSYSTEM_RCIN, rcio_rcin_update(state));
+        } else {
+            rcin_updated = false;
+        }
+
+        rcio_timed_update(RCIO_SUBSYSTEM_SAFETY, rcio_safety_update(state));
+
+        if (rcin_updated) {
+            rcio_telemetry_publish(state);
+        }
+
+        rcio_stats_cycle_end(RCIO_LOOP_FAST);
+        trace_rcio_cycle_end("fast");
+
+        rcio_idle_sleep();
+    }
+
+    return 0;
+}
+
+static int slow_worker(void *data)
+{
+    struct rcio_state *state = (struct rcio_state *) data;
+    bool adc_updated = false;
+    bool status_updated = false;
 
     while (!kthread_should_stop()) {
-        pwm_updated = rcio_pwm_update(state);
-        adc_updated = rcio_adc_update(state);
-        rcin_updated = rcio_rcin_update(state);
+        trace_rcio_cycle_start("slow");
+        rcio_stats_cycle_start(RCIO_LOOP_SLOW);
 
-        gpio_updated = rcio_gpio_update(state);
+        if (READ_ONCE(link_up)) {
+            adc_updated = rcio_timed_update(RCIO_SUBSYSTEM_ADC, rcio_adc_update(state));
+            rcio_timed_update(RCIO_SUBSYSTEM_GPIO, rcio_gpio_update(state));
+        } else {
+            adc_updated = false;
+        }
+
+        status_updated = rcio_timed_update(RCIO_SUBSYSTEM_STATUS, rcio_status_update(state));
+        rcio_timed_update(RCIO_SUBSYSTEM_HEALTH, rcio_health_update(state));
+
+        if (adc_updated || status_updated) {
+            rcio_telemetry_publish(state);
+        }
+
+        rcio_stats_cycle_end(RCIO_LOOP_SLOW);
+        trace_rcio_cycle_end("slow");
+
+        rcio_idle_sleep();
+    }
 
-        rcio_status_update(state);
-        rcio_safety_update(state);
+    return 0;
+}
+
+static struct task_struct *rcio_start_worker(int (*fn)(void *data), const char *name, int cpu)
+{
+    struct task_struct *worker = kthread_create(fn, (void *)&rcio_state, "%s", name);
 
-        if (pwm_updated || adc_updated || rcin_updated || gpio_updated) {
-            fail_counter = 0;
+    if (IS_ERR(worker)) {
+        return worker;
+    }
+
+    if (cpu >= 0) {
+        if (cpu < nr_cpu_ids && cpu_online(cpu)) {
+            kthread_bind(worker, cpu);
         } else {
-            fail_counter++;
+            dev_warn(rcio_state.adapter->dev, "rcio: CPU %d is not online, %s is not pinned\n", cpu, name);
         }
+    }
+
+    return worker;
+}
+
+void rcio_set_fifo(struct task_struct *worker)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0))
+    sched_set_fifo(worker);
+#else
+    struct sched_param param = { .sched_priority = MAX_RT_PRIO / 2 };
+
+    sched_setscheduler(worker, SCHED_FIFO, &param);
+#endif
+}
+
+static int rcio_start_workers(void)
+{
+    fast_task = rcio_start_worker(fast_worker, "rcio_fast", fast_cpu);
+
+    if (IS_ERR(fast_task)) {
+        return PTR_ERR(fast_task);
+    }
+
+    slow_task = rcio_start_worker(slow_worker, "rcio_slow", slow_cpu);
+
+    if (IS_ERR(slow_task)) {
+        kthread_stop(fast_task);
+        return PTR_ERR(slow_task);
+    }
 
-        usleep_range(1000, 1500);
-    } 
+    if (fast_rt) {
+        rcio_set_fifo(fast_task);
+    }
+
+    set_user_nice(slow_task, clamp(slow_nice, -20, 19));
+
+    wake_up_process(fast_task);
+    wake_up_process(slow_task);
 
     return 0;
 }
@@ -115,8 +412,27 @@ static int rcio_init(struct rcio_adapter *adapter)
     rcio_state.register_get_byte = register_get_byte;
     rcio_state.register_set_byte = register_set_byte;
     rcio_state.register_modify = register_modify;
+    rcio_state.register_transfer = register_transfer;
+    rcio_state.status_get = status_get;
+    spin_lock_init(&rcio_state.status_lock);
+    rcio_state.status_timeout = jiffies;
+    atomic_set(&rcio_state.transfers, 0);
+    atomic_set(&rcio_state.transfer_errors, 0);
+    rcio_state.last_transfer_ok = jiffies;
     mutex_init(&rcio_state.adapter->lock);
 
+    if (rcio_bus_probe(&rcio_state) < 0) {
+        goto errout_bus;
+    }
+
+    if (rcio_debug_probe(&rcio_state) < 0) {
+        goto errout_debug;
+    }
+
+    if (rcio_stats_probe(&rcio_state) < 0) {
+        goto errout_stats;
+    }
+
     if (!rcio_status_probe(&rcio_state)) {
         goto errout_status;
     }
@@ -151,10 +467,34 @@ static int rcio_init(struct rcio_adapter *adapter)
         goto errout_gpio;
     }
 
-    task = kthread_run(&worker, (void *)&rcio_state,"rcio_worker");
+    if (rcio_health_probe(&rcio_state) < 0) {
+        goto errout_health;
+    }
+
+    if (rcio_link_probe(&rcio_state) < 0) {
+        goto errout_link;
+    }
+
+    if (rcio_idle_probe(&rcio_state) < 0) {
+        goto errout_idle;
+    }
+
+    if (rcio_telemetry_probe(&rcio_state) < 0) {
+        goto errout_telemetry;
+    }
+
+    if (rcio_start_workers() < 0) {
+        goto errout_workers;
+    }
 
     return 0;
 
+errout_workers:
+    rcio_telemetry_remove(&rcio_state);
+errout_telemetry:
+errout_idle:
+errout_link:
+errout_health:
 errout_status:
 errout_safety:
 errout_rcin:
@@ -163,6 +503,10 @@ errout_gpio:
     rcio_gpio_remove(&rcio_state);
 errout_pwm:
 errout_adc:
+errout_stats:
+    rcio_debug_remove(&rcio_state);
+errout_debug:
+errout_bus:
     kobject_put(rcio_state.object);
     return -EIO;
 }
@@ -189,7 +533,10 @@ int rcio_remove(struct rcio_adapter *adapter)
 {
     int ret;
 
-    kthread_stop(task);
+    kthread_stop(fast_task);
+    kthread_stop(slow_task);
+
+    rcio_telemetry_remove(&rcio_state);
 
     mutex_destroy(&rcio_state.adapter->lock);
     ret = rcio_pwm_remove(&rcio_state);
@@ -197,12 +544,15 @@ int rcio_remove(struct rcio_adapter *adapter)
 
     rcio_stop();
 
+    rcio_debug_remove(&rcio_state);
+
     return ret;
 }
 
 EXPORT_SYMBOL_GPL(rcio_state);
 EXPORT_SYMBOL_GPL(rcio_probe);
 EXPORT_SYMBOL_GPL(rcio_remove);
+EXPORT_TRACEPOINT_SYMBOL_GPL(rcio_spi_xfer);
 
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
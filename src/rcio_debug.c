@@ -0,0 +1,479 @@
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
+#include <linux/slab.h>
+#define DEBUG
+#include <linux/device.h>
+
+#include "rcio.h"
+#include "protocol.h"
+#include "rcio_bus.h"
+#include "rcio_debug.h"
+#include "rcio_stats.h"
+
+#define rcio_debug_err(__dev, format, args...)\
+        dev_err(__dev, "rcio_debug: " format, ##args)
+
+/* PX4IO pages all fit below 128 */
+#define RCIO_DEBUG_PAGES 128
+
+/* call sites are hashed into a fixed table, ones that do not fit are only counted */
+#define RCIO_DEBUG_CALLERS_BITS 6
+#define RCIO_DEBUG_CALLERS (1 << RCIO_DEBUG_CALLERS_BITS)
+#define RCIO_DEBUG_TOP_CALLERS 16
+
+/* an uncontended bus is taken well within this */
+#define RCIO_DEBUG_CONTENDED_NS (10 * NSEC_PER_USEC)
+
+static const char *error_names[RCIO_DEBUG_ERRORS] = {
+    [RCIO_DEBUG_CRC] = "crc",
+    [RCIO_DEBUG_CODE_ERROR] = "code_error",
+    [RCIO_DEBUG_SHORT_READ] = "short_read",
+    [RCIO_DEBUG_STALE] = "stale",
+};
+
+struct rcio_debug_counters {
+    u64 reads;
+    u64 writes;
+    u64 regs_read;
+    u64 regs_written;
+    u64 failed;
+    u64 errors[RCIO_DEBUG_ERRORS];
+};
+
+struct rcio_debug_caller {
+    unsigned long ip;
+    u64 count;
+    u64 contended;
+    u64 total_wait_ns;
+    u64 max_wait_ns;
+    u64 total_hold_ns;
+    u64 max_hold_ns;
+};
+
+struct rcio_debug_stats {
+    struct rcio_debug_counters pages[RCIO_DEBUG_PAGES];
+    struct rcio_debug_counters classes[RCIO_BUS_CLASSES];
+    /* by the update the transfer was made for, the last row is everything outside the loops */
+    struct rcio_debug_counters subsystems[RCIO_SUBSYSTEMS + 1];
+    u64 lock_wait[RCIO_DEBUG_BUCKETS];
+    u64 bus_time[RCIO_DEBUG_BUCKETS];
+};
+
+/*
+ * Counters are per CPU and only ever bumped with this_cpu ops, so the bus
+ * path takes no lock for them. Readers sum over all CPUs; a reset racing
+ * with a transfer may lose that one increment, which is fine for these.
+ */
+static struct rcio_debug {
+    struct rcio_state *rcio;
+    struct dentry *dir;
+    struct rcio_debug_stats __percpu *stats;
+
+    /*
+     * Wait and hold times of the bus per call site, keyed on the return
+     * address into the core's register helpers. The bus is taken one
+     * caller at a time anyway, so a plain spinlock costs nothing here.
+     */
+    spinlock_t callers_lock;
+    struct rcio_debug_caller callers[RCIO_DEBUG_CALLERS];
+    u64 callers_dropped;
+} debug;
+
+int rcio_debug_bucket(u64 ns)
+{
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+
+    return us ? min(fls64(us), RCIO_DEBUG_BUCKETS - 1) : 0;
+}
+
+void rcio_debug_transfer(u8 page, bool write, u8 count, int ret, u64 wait_ns, u64 bus_ns)
+{
+    rcio_bus_class_t class = rcio_bus_classify(page, write);
+    rcio_subsystem_t subsystem = rcio_current_subsystem();
+
+    if (debug.stats == NULL || page >= RCIO_DEBUG_PAGES) {
+        return;
+    }
+
+    if (write) {
+        this_cpu_inc(debug.stats->pages[page].writes);
+        this_cpu_inc(debug.stats->classes[class].writes);
+        this_cpu_inc(debug.stats->subsystems[subsystem].writes);
+    } else {
+        this_cpu_inc(debug.stats->pages[page].reads);
+        this_cpu_inc(debug.stats->classes[class].reads);
+        this_cpu_inc(debug.stats->subsystems[subsystem].reads);
+    }
+
+    if (ret < 0) {
+        this_cpu_inc(debug.stats->pages[page].failed);
+        this_cpu_inc(debug.stats->classes[class].failed);
+        this_cpu_inc(debug.stats->subsystems[subsystem].failed);
+    } else if (write) {
+        this_cpu_add(debug.stats->pages[page].regs_written, count);
+        this_cpu_add(debug.stats->classes[class].regs_written, count);
+        this_cpu_add(debug.stats->subsystems[subsystem].regs_written, count);
+    } else {
+        this_cpu_add(debug.stats->pages[page].regs_read, count);
+        this_cpu_add(debug.stats->classes[class].regs_read, count);
+        this_cpu_add(debug.stats->subsystems[subsystem].regs_read, count);
+    }
+
+    /* the rest of a batch comes with no timing, it went with the first packet */
+    if (bus_ns == 0) {
+        return;
+    }
+
+    this_cpu_inc(debug.stats->lock_wait[rcio_debug_bucket(wait_ns)]);
+    this_cpu_inc(debug.stats->bus_time[rcio_debug_bucket(bus_ns)]);
+}
+
+void rcio_debug_error(u8 page, bool write, rcio_debug_error_t error)
+{
+    rcio_bus_class_t class = rcio_bus_classify(page, write);
+    rcio_subsystem_t subsystem = rcio_current_subsystem();
+
+    if (debug.stats == NULL || page >= RCIO_DEBUG_PAGES) {
+        return;
+    }
+
+    this_cpu_inc(debug.stats->pages[page].errors[error]);
+    this_cpu_inc(debug.stats->classes[class].errors[error]);
+    this_cpu_inc(debug.stats->subsystems[subsystem].errors[error]);
+}
+
+void rcio_debug_lock(unsigned long caller, u64 wait_ns, u64 hold_ns)
+{
+    u32 slot = hash_long(caller, RCIO_DEBUG_CALLERS_BITS);
+    struct rcio_debug_caller *entry = NULL;
+
+    spin_lock(&debug.callers_lock);
+
+    for (int i = 0; i < RCIO_DEBUG_CALLERS; i++) {
+        struct rcio_debug_caller *candidate = &debug.callers[(slot + i) % RCIO_DEBUG_CALLERS];
+
+        if (candidate->ip == caller || candidate->ip == 0) {
+            entry = candidate;
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        debug.callers_dropped++;
+        spin_unlock(&debug.callers_lock);
+        return;
+    }
+
+    entry->ip = caller;
+    entry->count++;
+    entry->total_wait_ns += wait_ns;
+    entry->max_wait_ns = max(entry->max_wait_ns, wait_ns);
+    entry->total_hold_ns += hold_ns;
+    entry->max_hold_ns = max(entry->max_hold_ns, hold_ns);
+
+    if (wait_ns >= RCIO_DEBUG_CONTENDED_NS) {
+        entry->contended++;
+    }
+
+    spin_unlock(&debug.callers_lock);
+}
+
+static void rcio_debug_sum(struct rcio_debug_counters *sum, const struct rcio_debug_counters *counters)
+{
+    sum->reads += counters->reads;
+    sum->writes += counters->writes;
+    sum->regs_read += counters->regs_read;
+    sum->regs_written += counters->regs_written;
+    sum->failed += counters->failed;
+
+    for (int i = 0; i < RCIO_DEBUG_ERRORS; i++) {
+        sum->errors[i] += counters->errors[i];
+    }
+}
+
+static void rcio_debug_header(struct seq_file *s, const char *first)
+{
+    seq_printf(s, "%s reads writes regs_read regs_written failed", first);
+
+    for (int i = 0; i < RCIO_DEBUG_ERRORS; i++) {
+        seq_printf(s, " %s", error_names[i]);
+    }
+
+    seq_putc(s, '\n');
+}
+
+static void rcio_debug_row(struct seq_file *s, const struct rcio_debug_counters *counters)
+{
+    seq_printf(s, " %llu %llu %llu %llu %llu", counters->reads, counters->writes, counters->regs_read,
+            counters->regs_written, counters->failed);
+
+    for (int i = 0; i < RCIO_DEBUG_ERRORS; i++) {
+        seq_printf(s, " %llu", counters->errors[i]);
+    }
+
+    seq_putc(s, '\n');
+}
+
+static int pages_show(struct seq_file *s, void *unused)
+{
+    rcio_debug_header(s, "page");
+
+    for (int page = 0; page < RCIO_DEBUG_PAGES; page++) {
+        struct rcio_debug_counters sum = {0};
+        int cpu;
+
+        for_each_possible_cpu(cpu) {
+            rcio_debug_sum(&sum, &per_cpu_ptr(debug.stats, cpu)->pages[page]);
+        }
+
+        /* only pages the driver has actually touched */
+        if (sum.reads == 0 && sum.writes == 0) {
+            continue;
+        }
+
+        seq_printf(s, "%d", page);
+        rcio_debug_row(s, &sum);
+    }
+
+    return 0;
+}
+
+static int classes_show(struct seq_file *s, void *unused)
+{
+    rcio_debug_header(s, "class");
+
+    for (int class = 0; class < RCIO_BUS_CLASSES; class++) {
+        struct rcio_debug_counters sum = {0};
+        int cpu;
+
+        for_each_possible_cpu(cpu) {
+            rcio_debug_sum(&sum, &per_cpu_ptr(debug.stats, cpu)->classes[class]);
+        }
+
+        seq_printf(s, "%s", rcio_bus_class_name(class));
+        rcio_debug_row(s, &sum);
+    }
+
+    return 0;
+}
+
+static int subsystems_show(struct seq_file *s, void *unused)
+{
+    rcio_debug_header(s, "subsystem");
+
+    for (int subsystem = 0; subsystem <= RCIO_SUBSYSTEMS; subsystem++) {
+        struct rcio_debug_counters sum = {0};
+        int cpu;
+
+        for_each_possible_cpu(cpu) {
+            rcio_debug_sum(&sum, &per_cpu_ptr(debug.stats, cpu)->subsystems[subsystem]);
+        }
+
+        seq_printf(s, "%s", subsystem < RCIO_SUBSYSTEMS ? rcio_stats_subsystem_name(subsystem) : "other");
+        rcio_debug_row(s, &sum);
+    }
+
+    return 0;
+}
+
+void rcio_debug_histogram(struct seq_file *s, const u64 *buckets)
+{
+    /* upper bound of the bucket in us and the number of samples that fell in it */
+    for (int i = 0; i < RCIO_DEBUG_BUCKETS - 1; i++) {
+        seq_printf(s, "<%u %llu\n", 1 << i, buckets[i]);
+    }
+
+    seq_printf(s, ">=%u %llu\n", 1 << (RCIO_DEBUG_BUCKETS - 2), buckets[RCIO_DEBUG_BUCKETS - 1]);
+}
+
+static void rcio_debug_percpu_histogram(struct seq_file *s, size_t offset)
+{
+    u64 sum[RCIO_DEBUG_BUCKETS] = {0};
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        const u64 *buckets = (const u64 *)((const char *)per_cpu_ptr(debug.stats, cpu) + offset);
+
+        for (int i = 0; i < RCIO_DEBUG_BUCKETS; i++) {
+            sum[i] += buckets[i];
+        }
+    }
+
+    rcio_debug_histogram(s, sum);
+}
+
+static int lock_wait_show(struct seq_file *s, void *unused)
+{
+    rcio_debug_percpu_histogram(s, offsetof(struct rcio_debug_stats, lock_wait));
+    return 0;
+}
+
+static int bus_time_show(struct seq_file *s, void *unused)
+{
+    rcio_debug_percpu_histogram(s, offsetof(struct rcio_debug_stats, bus_time));
+    return 0;
+}
+
+/* most total wait first */
+static int rcio_debug_caller_cmp(const void *a, const void *b)
+{
+    const struct rcio_debug_caller *left = a;
+    const struct rcio_debug_caller *right = b;
+
+    if (left->total_wait_ns == right->total_wait_ns) {
+        return 0;
+    }
+
+    return left->total_wait_ns < right->total_wait_ns ? 1 : -1;
+}
+
+static int lock_profile_show(struct seq_file *s, void *unused)
+{
+    struct rcio_debug_caller *callers;
+    u64 dropped;
+    u64 total_wait_ns = 0;
+
+    callers = kmalloc(sizeof(debug.callers), GFP_KERNEL);
+
+    if (callers == NULL) {
+        return -ENOMEM;
+    }
+
+    spin_lock(&debug.callers_lock);
+    memcpy(callers, debug.callers, sizeof(debug.callers));
+    dropped = debug.callers_dropped;
+    spin_unlock(&debug.callers_lock);
+
+    sort(callers, RCIO_DEBUG_CALLERS, sizeof(*callers), rcio_debug_caller_cmp, NULL);
+
+    for (int i = 0; i < RCIO_DEBUG_CALLERS; i++) {
+        total_wait_ns += callers[i].total_wait_ns;
+    }
+
+    seq_printf(s, "total_wait_us: %llu\ndropped: %llu\n", div_u64(total_wait_ns, NSEC_PER_USEC), dropped);
+    seq_puts(s, "caller count contended wait_share_pct avg_wait_us max_wait_us avg_hold_us max_hold_us\n");
+
+    for (int i = 0; i < RCIO_DEBUG_TOP_CALLERS && callers[i].ip != 0; i++) {
+        struct rcio_debug_caller *caller = &callers[i];
+
+        seq_printf(s, "%pS %llu %llu %llu %llu %llu %llu %llu\n", (void *)caller->ip, caller->count, caller->contended,
+                total_wait_ns ? div64_u64(caller->total_wait_ns * 100, total_wait_ns) : 0,
+                div_u64(div64_u64(caller->total_wait_ns, caller->count), NSEC_PER_USEC),
+                div_u64(caller->max_wait_ns, NSEC_PER_USEC),
+                div_u64(div64_u64(caller->total_hold_ns, caller->count), NSEC_PER_USEC),
+                div_u64(caller->max_hold_ns, NSEC_PER_USEC));
+    }
+
+    kfree(callers);
+
+    return 0;
+}
+
+#define RCIO_DEBUG_SHOW_FOPS(__name) \
+static int __name##_open(struct inode *inode, struct file *file) \
+{ \
+    return single_open(file, __name##_show, inode->i_private); \
+} \
+\
+static const struct file_operations __name##_fops = { \
+    .owner = THIS_MODULE, \
+    .open = __name##_open, \
+    .read = seq_read, \
+    .llseek = seq_lseek, \
+    .release = single_release, \
+}
+
+RCIO_DEBUG_SHOW_FOPS(pages);
+RCIO_DEBUG_SHOW_FOPS(classes);
+RCIO_DEBUG_SHOW_FOPS(subsystems);
+RCIO_DEBUG_SHOW_FOPS(lock_wait);
+RCIO_DEBUG_SHOW_FOPS(bus_time);
+RCIO_DEBUG_SHOW_FOPS(lock_profile);
+
+static ssize_t reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(debug.stats, cpu), 0, sizeof(struct rcio_debug_stats));
+    }
+
+    spin_lock(&debug.callers_lock);
+    memset(debug.callers, 0, sizeof(debug.callers));
+    debug.callers_dropped = 0;
+    spin_unlock(&debug.callers_lock);
+
+    return count;
+}
+
+static const struct file_operations reset_fops = {
+    .owner = THIS_MODULE,
+    .write = reset_write,
+};
+
+/* NULL when debugfs is not available */
+struct dentry *rcio_debug_dir(void)
+{
+    return debug.dir;
+}
+
+int rcio_debug_probe(struct rcio_state *state)
+{
+    debug.rcio = state;
+
+    spin_lock_init(&debug.callers_lock);
+
+    debug.stats = alloc_percpu(struct rcio_debug_stats);
+
+    if (debug.stats == NULL) {
+        rcio_debug_err(state->adapter->dev, "no memory for statistics\n");
+        return -ENOMEM;
+    }
+
+    /* debugfs is optional, the counters still run without it */
+    debug.dir = debugfs_create_dir("rcio", NULL);
+
+    if (IS_ERR_OR_NULL(debug.dir)) {
+        debug.dir = NULL;
+        return 0;
+    }
+
+    debugfs_create_file("pages", S_IRUGO, debug.dir, NULL, &pages_fops);
+    debugfs_create_file("classes", S_IRUGO, debug.dir, NULL, &classes_fops);
+    debugfs_create_file("subsystems", S_IRUGO, debug.dir, NULL, &subsystems_fops);
+    debugfs_create_file("lock_wait", S_IRUGO, debug.dir, NULL, &lock_wait_fops);
+    debugfs_create_file("bus_time", S_IRUGO, debug.dir, NULL, &bus_time_fops);
+    debugfs_create_file("lock_profile", S_IRUGO, debug.dir, NULL, &lock_profile_fops);
+    debugfs_create_file("reset", S_IWUSR, debug.dir, NULL, &reset_fops);
+
+    return 0;
+}
+
+void rcio_debug_remove(struct rcio_state *state)
+{
+    struct rcio_debug_stats __percpu *stats = debug.stats;
+
+    debugfs_remove_recursive(debug.dir);
+    debug.dir = NULL;
+
+    debug.stats = NULL;
+    free_percpu(stats);
+}
+
+EXPORT_SYMBOL_GPL(rcio_debug_probe);
+EXPORT_SYMBOL_GPL(rcio_debug_remove);
+EXPORT_SYMBOL_GPL(rcio_debug_transfer);
+EXPORT_SYMBOL_GPL(rcio_debug_error);
+EXPORT_SYMBOL_GPL(rcio_debug_lock);
+EXPORT_SYMBOL_GPL(rcio_debug_bucket);
+EXPORT_SYMBOL_GPL(rcio_debug_histogram);
+EXPORT_SYMBOL_GPL(rcio_debug_dir);
+MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
+MODULE_DESCRIPTION("RCIO bus statistics");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,28 @@
+#ifndef _RCIO_DEBUG_H
+#define _RCIO_DEBUG_H
+
+#include "rcio.h"
+#include "rcio_bus.h"
+
+struct seq_file;
+struct dentry;
+
+/* latency buckets are powers of two in us, the last one catches the rest */
+#define RCIO_DEBUG_BUCKETS 16
+
+/* reply problems only the adapter can tell apart */
+typedef enum {
+    RCIO_DEBUG_CRC = 0, RCIO_DEBUG_CODE_ERROR, RCIO_DEBUG_SHORT_READ, RCIO_DEBUG_STALE,
+    RCIO_DEBUG_ERRORS
+} rcio_debug_error_t;
+
+int rcio_debug_probe(struct rcio_state *state);
+void rcio_debug_remove(struct rcio_state *state);
+void rcio_debug_transfer(u8 page, bool write, u8 count, int ret, u64 wait_ns, u64 bus_ns);
+void rcio_debug_error(u8 page, bool write, rcio_debug_error_t error);
+void rcio_debug_lock(unsigned long caller, u64 wait_ns, u64 hold_ns);
+int rcio_debug_bucket(u64 ns);
+void rcio_debug_histogram(struct seq_file *s, const u64 *buckets);
+struct dentry *rcio_debug_dir(void);
+
+#endif
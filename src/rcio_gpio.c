@@ -2,10 +2,18 @@
 #include <linux/slab.h>
 #include <linux/device.h>
 #include <linux/gpio/driver.h>
+#include <linux/irq.h>
+#include <linux/irqdomain.h>
 #include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/version.h>
 #include "rcio.h"
 #include "protocol.h"
 #include "rcio_pwm.h"
+#include "rcio_idle.h"
 
 //#define DEBUG
 
@@ -20,36 +28,180 @@
 #define rcio_gpio_debug(__dev, format, args...)\
         dev_dbg(__dev, "rcio_gpio: " format, ##args)
 
+#define RCIO_GPIO_MIN_SAMPLE_RATE_HZ 1
+/* inputs nobody asked about for this long are no longer sampled without IRQs on them */
+#define RCIO_GPIO_READER_TIMEOUT (HZ)
+#define RCIO_GPIO_MAX_SAMPLE_RATE_HZ 1000
+
+/* how often the worker re-reads the running motors while someone reads status */
+#define RCIO_GPIO_VERIFY_PERIOD (HZ)
+/* how long after the last status read the worker keeps doing that */
+#define RCIO_GPIO_STATUS_READER_TIMEOUT (5 * HZ)
+
+#define RCIO_GPIO_WAVEFORM_MAX_STEPS 64
+#define RCIO_GPIO_WAVEFORM_MAX_STEP_US 10000000
+
 bool gpio_supported = false;
 
 uint16_t pwm_ignore_writings_mask = 0;
 
+extern uint16_t pwm_exported_mask;
+
+/*
+ * Input pins are sampled by the worker at sample_rate_hz into a cache
+ * that get() serves, and level changes are turned into nested interrupts
+ * on the pins that asked for them, so gpiolib edge events work without
+ * anybody polling the bus.
+ */
 static struct rcio_gpio {
     int counter;
-    int pin_states_updated;
+    unsigned long dirty;
+    uint16_t exported;
     uint16_t pin_states[RCIO_PWM_MAX_CHANNELS];
     struct rcio_state *rcio;
+
+    unsigned int sample_rate_hz;
+    unsigned long sample_timeout;
+    unsigned long sampled;
+    unsigned long levels_read;
+    bool levels_valid;
+    uint16_t levels;
+
+    struct irq_domain *domain;
+    unsigned long irq_enabled;
+    unsigned long irq_rising;
+    unsigned long irq_falling;
+
+    /*
+     * Served by status. Only the driver writes the exported pages and the
+     * features never change, so those come from probe and our own writes,
+     * the running count is the only thing re-read from the IO.
+     */
+    uint16_t features;
+    spinlock_t status_lock;
+    unsigned long status_read;
+    unsigned long verify_timeout;
+    bool verified_valid;
+    unsigned long verified;
+    int verified_running;
 } gpio;
 
+/*
+ * A waveform is a list of steps, each setting the pins in mask to value and
+ * then holding for duration_us. The firmware has no notion of timed output,
+ * so a dedicated thread plays it back against absolute hrtimer deadlines and
+ * logs when each step actually went out on the bus.
+ */
+struct rcio_gpio_waveform_step {
+    uint16_t mask;
+    uint16_t value;
+    u32 duration_us;
+};
+
+static struct rcio_gpio_waveform {
+    struct task_struct *task;
+    struct mutex lock;
+    wait_queue_head_t wait;
+    bool pending;
+    bool running;
+    bool cancel;
+    int error;
+
+    int count;
+    struct rcio_gpio_waveform_step steps[RCIO_GPIO_WAVEFORM_MAX_STEPS];
+    s64 emitted_us[RCIO_GPIO_WAVEFORM_MAX_STEPS];
+} waveform;
+
 bool rcio_gpio_update(struct rcio_state *state);
-bool rcio_gpio_force_update(struct rcio_state *state);
 
-#define update_required (gpio.pin_states_updated > 0)
-#define update_dequeue  gpio.pin_states_updated--
-#define update_enqueue    gpio.pin_states_updated++
+static inline void gpio_mark_dirty(unsigned pin_number) {
+    set_bit(pin_number, &gpio.dirty);
+    rcio_idle_kick();
+}
+
+static inline void gpio_mark_all_dirty(void) {
+    for (int i = 0; i < RCIO_PWM_MAX_CHANNELS; i++) gpio_mark_dirty(i);
+}
+
+/*
+ * Writes out the pins changed since the last flush. A transaction costs far
+ * more than a few extra registers in it, so the whole span from the first
+ * to the last dirty pin goes out as one write, clean pins in between just
+ * get their current value again.
+ */
+static int gpio_flush(struct rcio_state *state) {
+    unsigned long dirty = xchg(&gpio.dirty, 0);
+    unsigned first, last, pin;
+    int result;
+
+    if (dirty == 0) return 0;
+
+    first = find_first_bit(&dirty, RCIO_PWM_MAX_CHANNELS);
+    last = find_last_bit(&dirty, RCIO_PWM_MAX_CHANNELS);
 
+    result = state->register_set(state, PX4IO_PAGE_GPIO, first, &(gpio.pin_states[first]), last - first + 1);
+    if (result < 0) {
+        /* try again on the next worker pass */
+        for_each_set_bit(pin, &dirty, RCIO_PWM_MAX_CHANNELS) gpio_mark_dirty(pin);
+    }
+
+    return result;
+}
+
+static int gpio_verify(struct rcio_state *state)
+{
+    int motors_running_count = pwm_check_device_motors_running_count(state);
+
+    if (motors_running_count < 0) return motors_running_count;
+
+    spin_lock(&gpio.status_lock);
+    gpio.verified_running = motors_running_count;
+    gpio.verified = jiffies;
+    gpio.verified_valid = true;
+    spin_unlock(&gpio.status_lock);
+
+    return 0;
+}
+
+/*
+ * Never touches the bus. Reading it keeps the worker refreshing the running
+ * count for a while, see refresh for a synchronous read.
+ */
 static ssize_t status_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-    int read_result;
-    int motors_running_count = 0;
-    uint16_t gpio_exported, pwm_exported, setup_features;
+    int motors_running_count;
+    unsigned long verified;
+    bool valid;
+
+    WRITE_ONCE(gpio.status_read, jiffies);
+    rcio_idle_kick();
+
+    spin_lock(&gpio.status_lock);
+    valid = gpio.verified_valid;
+    verified = gpio.verified;
+    motors_running_count = gpio.verified_running;
+    spin_unlock(&gpio.status_lock);
+
+    if (!valid) {
+        return sprintf(buf, "pwm exported: 0x%x, gpio exported: 0x%x, pwm running: unknown.\nFeatures: 0x%x\n",
+                pwm_exported_mask, gpio.exported, gpio.features);
+    }
 
-    read_result = gpio.rcio->register_get(gpio.rcio, PX4IO_PAGE_PWM_EXPORTED, 0, &pwm_exported, 1);
-    read_result = gpio.rcio->register_get(gpio.rcio, PX4IO_PAGE_GPIO_EXPORTED, 0, &gpio_exported, 1);
-    read_result = gpio.rcio->register_get(gpio.rcio, PX4IO_PAGE_SETUP, PX4IO_P_SETUP_FEATURES, &setup_features, 1);
+    return sprintf(buf, "pwm exported: 0x%x, gpio exported: 0x%x, pwm running: %d.\nFeatures: 0x%x\n"
+            "verified: %u ms ago\n", pwm_exported_mask, gpio.exported, motors_running_count, gpio.features,
+            jiffies_to_msecs(jiffies - verified));
+}
+
+static ssize_t refresh_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    int ret = gpio_verify(gpio.rcio);
 
-    motors_running_count = pwm_check_device_motors_running_count(gpio.rcio);
-    return sprintf(buf, "pwm exported: 0x%x, gpio exported: 0x%x, pwm running: %d.\nFeatures: 0x%x\n", pwm_exported, gpio_exported, motors_running_count, setup_features);
+    if (ret < 0) {
+        rcio_gpio_err(gpio.rcio->adapter->dev, "Could not read GPIO status: %d\n", ret);
+        return ret;
+    }
+
+    return count;
 }
 
 static ssize_t reset_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
@@ -67,12 +219,16 @@ static ssize_t reset_store(struct kobject *kobj, struct kobj_attribute *attr, co
             PX4IO_GPIO_SET_PIN_STATE_LOW(gpio.pin_states[i]);
         }
     }
-    result = gpio.rcio->register_set(gpio.rcio, PX4IO_PAGE_GPIO, 0, &(gpio.pin_states[0]), RCIO_PWM_MAX_CHANNELS);
+    gpio_mark_all_dirty();
+    result = gpio_flush(gpio.rcio);
 
     //clearing them
     for (int i = 0; i < RCIO_PWM_MAX_CHANNELS; i++) gpio.pin_states[i] = 0;
+    gpio_mark_all_dirty();
+    result = gpio_flush(gpio.rcio);
 
     result = gpio.rcio->register_set(gpio.rcio, PX4IO_PAGE_GPIO_EXPORTED, 0, &gpio_exported, 1);
+    gpio.exported = gpio_exported;
 
     rcio_gpio_warn(gpio.rcio->adapter->dev, "All GPIO pins cleared\n");
 
@@ -108,12 +264,152 @@ static ssize_t pwmignore_store(struct kobject *kobj, struct kobj_attribute *attr
     return count;
 }
 
+static ssize_t sample_rate_hz_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", gpio.sample_rate_hz);
+}
+
+static ssize_t sample_rate_hz_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int value;
+
+    if (kstrtouint(buf, 10, &value) < 0 || value < RCIO_GPIO_MIN_SAMPLE_RATE_HZ || value > RCIO_GPIO_MAX_SAMPLE_RATE_HZ) {
+        rcio_gpio_err(gpio.rcio->adapter->dev, "Invalid value for sample_rate_hz, this should be from %d to %d\n",
+                RCIO_GPIO_MIN_SAMPLE_RATE_HZ, RCIO_GPIO_MAX_SAMPLE_RATE_HZ);
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(gpio.sample_rate_hz, value);
+
+    return count;
+}
+
+static ssize_t waveform_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    const char *state;
+    ssize_t len;
+    s64 target_us = 0;
+
+    mutex_lock(&waveform.lock);
+
+    state = waveform.running ? "running" : waveform.pending ? "queued" : "idle";
+    len = scnprintf(buf, PAGE_SIZE, "state: %s\nerror: %d\n", state, waveform.error);
+
+    /* offsets are from the first step, late is how far behind schedule the step went out */
+    len += scnprintf(buf + len, PAGE_SIZE - len, "step mask value duration_us offset_us late_us\n");
+    for (int i = 0; i < waveform.count; i++) {
+        struct rcio_gpio_waveform_step *step = &waveform.steps[i];
+
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%d 0x%x 0x%x %u %lld %lld\n", i, step->mask, step->value,
+                step->duration_us, waveform.emitted_us[i],
+                waveform.emitted_us[i] < 0 ? 0 : waveform.emitted_us[i] - target_us);
+        target_us += step->duration_us;
+    }
+
+    mutex_unlock(&waveform.lock);
+
+    return len;
+}
+
+static int waveform_parse(char *buf, struct rcio_gpio_waveform_step *steps)
+{
+    char *token;
+    int count = 0;
+
+    while ((token = strsep(&buf, " \t\n")) != NULL) {
+        struct rcio_gpio_waveform_step *step = &steps[count];
+        unsigned int mask, value, duration_us;
+
+        if (*token == '\0') continue;
+
+        if (count == RCIO_GPIO_WAVEFORM_MAX_STEPS) return -E2BIG;
+
+        if (sscanf(token, "%x:%x:%u", &mask, &value, &duration_us) != 3 || mask == 0 || mask > 0xffff ||
+                duration_us > RCIO_GPIO_WAVEFORM_MAX_STEP_US) {
+            return -EINVAL;
+        }
+
+        /* only pins exported as GPIO outputs can be driven */
+        for (int pin = 0; pin < RCIO_PWM_MAX_CHANNELS; pin++) {
+            if (!(mask & (1 << pin))) continue;
+
+            if (!(gpio.exported & (1 << pin)) ||
+                    PX4IO_GPIO_GET_PIN_DIRECTION(gpio.pin_states[pin]) != PX4IO_GPIO_PIN_DIRECTION_OUTPUT) {
+                return -EINVAL;
+            }
+        }
+
+        step->mask = mask;
+        step->value = value & mask;
+        step->duration_us = duration_us;
+        count++;
+    }
+
+    return count;
+}
+
+/* "mask:value:duration_us ..." in hex, hex and decimal, or "stop" */
+static ssize_t waveform_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    struct rcio_gpio_waveform_step *steps;
+    char *copy;
+    int ret;
+
+    if (sysfs_streq(buf, "stop")) {
+        WRITE_ONCE(waveform.cancel, true);
+        wake_up_process(waveform.task);
+        return count;
+    }
+
+    steps = kcalloc(RCIO_GPIO_WAVEFORM_MAX_STEPS, sizeof(*steps), GFP_KERNEL);
+    copy = kstrndup(buf, count, GFP_KERNEL);
+    if (steps == NULL || copy == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = waveform_parse(copy, steps);
+    if (ret <= 0) {
+        rcio_gpio_err(gpio.rcio->adapter->dev, "Invalid value for waveform, this should be up to %d steps of "
+                "mask:value:duration_us on GPIO outputs\n", RCIO_GPIO_WAVEFORM_MAX_STEPS);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    mutex_lock(&waveform.lock);
+    if (waveform.pending || waveform.running) {
+        mutex_unlock(&waveform.lock);
+        ret = -EBUSY;
+        goto out;
+    }
+
+    memcpy(waveform.steps, steps, ret * sizeof(*steps));
+    for (int i = 0; i < ret; i++) waveform.emitted_us[i] = -1;
+    waveform.count = ret;
+    waveform.error = 0;
+    waveform.cancel = false;
+    waveform.pending = true;
+    mutex_unlock(&waveform.lock);
+
+    wake_up(&waveform.wait);
+    ret = count;
+
+out:
+    kfree(copy);
+    kfree(steps);
+    return ret;
+}
+
 static struct kobj_attribute status_attribute = __ATTR_RO(status);
 static struct kobj_attribute reset_attribute = __ATTR_RW(reset);
 static struct kobj_attribute pwmignore_attribute = __ATTR_RW(pwmignore);
+static struct kobj_attribute sample_rate_hz_attribute = __ATTR_RW(sample_rate_hz);
+static struct kobj_attribute waveform_attribute = __ATTR_RW(waveform);
+static struct kobj_attribute refresh_attribute = __ATTR(refresh, S_IWUSR, NULL, refresh_store);
 
 static struct attribute *attrs[] = {
-    &status_attribute.attr, &reset_attribute.attr, &pwmignore_attribute.attr, NULL,
+    &status_attribute.attr, &reset_attribute.attr, &pwmignore_attribute.attr, &sample_rate_hz_attribute.attr,
+    &waveform_attribute.attr, &refresh_attribute.attr, NULL,
 };
 
 static struct attribute_group attr_group = {
@@ -121,31 +417,93 @@ static struct attribute_group attr_group = {
     .attrs = attrs,
 };
 
+static unsigned long gpio_sample_period(void) {
+    return max(msecs_to_jiffies(1000 / READ_ONCE(gpio.sample_rate_hz)), 1UL);
+}
+
+/* the cache is good for as long as the worker keeps refreshing it */
+static bool gpio_levels_fresh(void) {
+    return gpio.levels_valid && time_before(jiffies, gpio.sampled + 2 * gpio_sample_period());
+}
+
+/* a reader within the last RCIO_GPIO_READER_TIMEOUT keeps the sampling going */
+static bool gpio_levels_wanted(void) {
+    return time_before(jiffies, READ_ONCE(gpio.levels_read) + RCIO_GPIO_READER_TIMEOUT);
+}
+
 static int gpio_chip_get(struct gpio_chip *chip, unsigned offset) {
     uint16_t pin_state;
     int result = 0;
     offset += GPIO_PIN_OFFSET;
+
+    rcio_idle_kick();
+    WRITE_ONCE(gpio.levels_read, jiffies);
+
+    if (gpio_levels_fresh()) {
+        return (READ_ONCE(gpio.levels) >> offset) & 1;
+    }
+
     result = gpio.rcio->register_get(gpio.rcio, PX4IO_PAGE_GPIO, offset, &pin_state, 1);
     rcio_gpio_debug(gpio.rcio->adapter->dev, "Pin [%d] is now 0x%x, result %d", offset, pin_state, result);
     return PX4IO_GPIO_GET_PIN_STATE(pin_state);
 }
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0))
+/* reads only the span of pins asked for, in one transaction */
+static int gpio_chip_get_multiple(struct gpio_chip *chip, unsigned long *mask, unsigned long *bits) {
+    uint16_t pin_states[RCIO_PWM_MAX_CHANNELS];
+    unsigned first, last;
+    int result;
+
+    rcio_idle_kick();
+    WRITE_ONCE(gpio.levels_read, jiffies);
+
+    if (gpio_levels_fresh()) {
+        uint16_t levels = READ_ONCE(gpio.levels) >> GPIO_PIN_OFFSET;
+        *bits = (*bits & ~*mask) | (levels & *mask);
+        return 0;
+    }
+
+    first = find_first_bit(mask, chip->ngpio);
+    if (first >= chip->ngpio) return 0;
+    last = find_last_bit(mask, chip->ngpio);
+
+    result = gpio.rcio->register_get(gpio.rcio, PX4IO_PAGE_GPIO, first + GPIO_PIN_OFFSET,
+            &pin_states[first], last - first + 1);
+    if (result < 0) return result;
+
+    for (unsigned offset = first; offset <= last; offset++) {
+        if (!test_bit(offset, mask)) continue;
+
+        if (PX4IO_GPIO_GET_PIN_STATE(pin_states[offset])) {
+            set_bit(offset, bits);
+        } else {
+            clear_bit(offset, bits);
+        }
+    }
+
+    return 0;
+}
+#endif
+
 static inline int gpio_unexport_pwm_pin(uint16_t current_pwm_exported, uint16_t pin_number) {
+	int write_result;
 	current_pwm_exported &= ~(1 << pin_number);
-	return gpio.rcio->register_set(gpio.rcio, PX4IO_PAGE_PWM_EXPORTED, 0, &current_pwm_exported, 1);
+	write_result = gpio.rcio->register_set(gpio.rcio, PX4IO_PAGE_PWM_EXPORTED, 0, &current_pwm_exported, 1);
+	if (write_result >= 0) pwm_exported_mask = current_pwm_exported;
+	return write_result;
 }
 
 static inline int gpio_export_gpio_pin(uint16_t pin_number) {
-	int read_result, write_result;
-	uint16_t gpio_exported;
-	read_result = gpio.rcio->register_get(gpio.rcio, PX4IO_PAGE_GPIO_EXPORTED, 0, &gpio_exported, 1);
-	if (read_result < 0) return read_result;
+	int write_result;
+	uint16_t gpio_exported = gpio.exported;
 	
 	set_bit_m(gpio_exported, pin_number);
 	
 	write_result = gpio.rcio->register_set(gpio.rcio, PX4IO_PAGE_GPIO_EXPORTED, 0, &gpio_exported, 1);
 	if (write_result < 0) return write_result;
 	
+	gpio.exported = gpio_exported;
 	return 0;
 }
 
@@ -157,12 +515,13 @@ static inline int gpio_unexport_gpio_pin(uint16_t gpio_exported, uint16_t pin_nu
     write_result = (gpio.rcio->register_set(gpio.rcio, PX4IO_PAGE_GPIO_EXPORTED, 0, &gpio_exported, 1));
     if (write_result < 0) return write_result;
     
+	gpio.exported = gpio_exported;
 	return 0;
 }
 
 static int gpio_chip_request(struct gpio_chip *chip, unsigned offset) {
-    uint16_t pwm_exported;
-    int read_result, write_result;
+    uint16_t pwm_exported = pwm_exported_mask;
+    int write_result;
     int pwm_running = 0;
     offset += GPIO_PIN_OFFSET;
     
@@ -176,9 +535,6 @@ static int gpio_chip_request(struct gpio_chip *chip, unsigned offset) {
         rcio_pwm_force_zero_duty(gpio.rcio);
     }
 
-    read_result = gpio.rcio->register_get(gpio.rcio, PX4IO_PAGE_PWM_EXPORTED, 0, &pwm_exported, 1);
-    if (read_result < 0) return read_result;
-
     if (pwm_exported & (1 << offset)) {
         //this pin is already exported as pwm one
         rcio_gpio_warn(gpio.rcio->adapter->dev, "Exporting warning: this pin [%d] is already exported as PWM\n", offset);
@@ -194,14 +550,12 @@ static int gpio_chip_request(struct gpio_chip *chip, unsigned offset) {
 	write_result = gpio_export_gpio_pin(offset);
 	if (write_result < 0) return write_result;
 	
+	/* enabled as a low output, the worker writes it out on its next pass */
 	gpio.pin_states[offset] = 0x0000;
 	PX4IO_GPIO_SET_PIN_GPIO_ENABLE(gpio.pin_states[offset]);
-	rcio_gpio_force_update(gpio.rcio);
-	
 	PX4IO_GPIO_SET_PIN_DIRECTION_OUTPUT(gpio.pin_states[offset]);
 	PX4IO_GPIO_SET_PIN_STATE_LOW(gpio.pin_states[offset]);
-	rcio_gpio_force_update(gpio.rcio);
-	update_enqueue;
+	gpio_mark_dirty(offset);
 
 	rcio_gpio_warn(gpio.rcio->adapter->dev, "Exporting pin [%d] OK\n", (int)offset);
 	return 0;
@@ -209,8 +563,7 @@ static int gpio_chip_request(struct gpio_chip *chip, unsigned offset) {
 }
 
 static void gpio_chip_free(struct gpio_chip *chip, unsigned offset) {
-    uint16_t gpio_exported;
-    int read_result, write_result, pwm_running;
+    int write_result, pwm_running;
     offset += GPIO_PIN_OFFSET;
     
     pwm_running = pwm_check_device_motors_running_count(gpio.rcio);
@@ -225,22 +578,17 @@ static void gpio_chip_free(struct gpio_chip *chip, unsigned offset) {
     
     rcio_gpio_warn(gpio.rcio->adapter->dev, "Unexporting pin [%d]\n", offset);
 
-    read_result = gpio.rcio->register_get(gpio.rcio, PX4IO_PAGE_GPIO_EXPORTED, 0, &gpio_exported, 1);
-    if (read_result < 0) {
-        rcio_gpio_err(gpio.rcio->adapter->dev, "Error on register_get %d\n", read_result);
-        return;
-    }
-
-    //forcing the pin value to zero, then set gpio value to 0 (not exported to everything)
-    PX4IO_GPIO_SET_PIN_STATE_LOW(gpio.pin_states[offset]);
-    rcio_gpio_force_update(gpio.rcio);
+    //the pin has to be low and disabled on the IO before it stops being a GPIO
     gpio.pin_states[offset] = 0;
-    rcio_gpio_force_update(gpio.rcio);
-    update_enqueue;
+    gpio_mark_dirty(offset);
+    write_result = gpio_flush(gpio.rcio);
+    if (write_result < 0) {
+        rcio_gpio_err(gpio.rcio->adapter->dev, "Error on register_set %d\n", write_result);
+    }
 
-	write_result = gpio_unexport_gpio_pin(gpio_exported, offset);
+	write_result = gpio_unexport_gpio_pin(gpio.exported, offset);
     if (write_result < 0) {
-        rcio_gpio_err(gpio.rcio->adapter->dev, "Error on register_set %d\n", read_result);
+        rcio_gpio_err(gpio.rcio->adapter->dev, "Error on register_set %d\n", write_result);
     }
     
     pwmignore_do_unignore_pin(offset);
@@ -255,9 +603,27 @@ static void gpio_chip_set(struct gpio_chip *chip, unsigned offset, int value) {
     } else {
         PX4IO_GPIO_SET_PIN_STATE_HIGH(gpio.pin_states[offset]);
     }
-    update_enqueue;
+    gpio_mark_dirty(offset);
 }
 
+/* unlike set() this goes out right away, together with anything else pending */
+static void gpio_chip_set_multiple(struct gpio_chip *chip, unsigned long *mask, unsigned long *bits) {
+    unsigned offset;
+
+    rcio_gpio_debug(gpio.rcio->adapter->dev, "Setting pins 0x%lx to 0x%lx\n", *mask, *bits & *mask);
+
+    for_each_set_bit(offset, mask, chip->ngpio) {
+        PX4IO_GPIO_SET_PIN_GPIO_ENABLE(gpio.pin_states[offset + GPIO_PIN_OFFSET]);
+        if (test_bit(offset, bits)) {
+            PX4IO_GPIO_SET_PIN_STATE_HIGH(gpio.pin_states[offset + GPIO_PIN_OFFSET]);
+        } else {
+            PX4IO_GPIO_SET_PIN_STATE_LOW(gpio.pin_states[offset + GPIO_PIN_OFFSET]);
+        }
+        gpio_mark_dirty(offset + GPIO_PIN_OFFSET);
+    }
+
+    gpio_flush(gpio.rcio);
+}
 
 //returns direction for signal "offset", 0=out, 1=in
 static int gpio_get_direction(struct gpio_chip *chip, unsigned offset) {
@@ -269,49 +635,287 @@ static int gpio_direction_input(struct gpio_chip *chip, unsigned offset) {
     offset += GPIO_PIN_OFFSET;
     rcio_gpio_debug(gpio.rcio->adapter->dev, "direction_input on %d\n", offset);
     PX4IO_GPIO_SET_PIN_DIRECTION_INPUT(gpio.pin_states[offset]);
-    rcio_gpio_force_update(gpio.rcio);
+    gpio_mark_dirty(offset);
     return 0;
 }
 static int gpio_direction_output(struct gpio_chip *chip, unsigned offset, int value) {
     offset += GPIO_PIN_OFFSET;
 	rcio_gpio_debug(gpio.rcio->adapter->dev, "direction_output on %d value %d\n", offset, value);
     PX4IO_GPIO_SET_PIN_DIRECTION_OUTPUT(gpio.pin_states[offset]);
-    rcio_gpio_force_update(gpio.rcio);
+    if (value == 0) {
+        PX4IO_GPIO_SET_PIN_STATE_LOW(gpio.pin_states[offset]);
+    } else {
+        PX4IO_GPIO_SET_PIN_STATE_HIGH(gpio.pin_states[offset]);
+    }
+    gpio_mark_dirty(offset);
+    return 0;
+}
+
+static void gpio_irq_mask(struct irq_data *data) {
+    clear_bit(irqd_to_hwirq(data), &gpio.irq_enabled);
+}
+
+static void gpio_irq_unmask(struct irq_data *data) {
+    set_bit(irqd_to_hwirq(data), &gpio.irq_enabled);
+}
+
+static int gpio_irq_set_type(struct irq_data *data, unsigned int type) {
+    irq_hw_number_t hwirq = irqd_to_hwirq(data);
+
+    /* levels are only known at the sampling rate, so there are only edges */
+    if (type & ~IRQ_TYPE_EDGE_BOTH) return -EINVAL;
+
+    if (type & IRQ_TYPE_EDGE_RISING) {
+        set_bit(hwirq, &gpio.irq_rising);
+    } else {
+        clear_bit(hwirq, &gpio.irq_rising);
+    }
+
+    if (type & IRQ_TYPE_EDGE_FALLING) {
+        set_bit(hwirq, &gpio.irq_falling);
+    } else {
+        clear_bit(hwirq, &gpio.irq_falling);
+    }
+
+    return 0;
+}
+
+static struct irq_chip gpio_irq_chip = {
+    .name = "rcio-gpio",
+    .irq_mask = gpio_irq_mask,
+    .irq_unmask = gpio_irq_unmask,
+    .irq_set_type = gpio_irq_set_type,
+};
+
+static int gpio_irq_map(struct irq_domain *domain, unsigned int irq, irq_hw_number_t hwirq) {
+    irq_set_chip_data(irq, &gpio);
+    irq_set_chip_and_handler(irq, &gpio_irq_chip, handle_simple_irq);
+    /* raised from the worker thread, handlers run right there */
+    irq_set_nested_thread(irq, 1);
+    irq_set_noprobe(irq);
     return 0;
 }
 
+static const struct irq_domain_ops gpio_irq_domain_ops = {
+    .map = gpio_irq_map,
+    .xlate = irq_domain_xlate_twocell,
+};
+
+static int gpio_chip_to_irq(struct gpio_chip *chip, unsigned offset) {
+    return irq_create_mapping(gpio.domain, offset);
+}
+
 static struct gpio_chip gpiochip = {
     .set = gpio_chip_set,
     .get = gpio_chip_get,
+    .set_multiple = gpio_chip_set_multiple,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0))
+    .get_multiple = gpio_chip_get_multiple,
+#endif
     .get_direction = gpio_get_direction,
     .direction_input = gpio_direction_input,
     .direction_output = gpio_direction_output,
     .request = gpio_chip_request,
     .free = gpio_chip_free,
+    .to_irq = gpio_chip_to_irq,
     .label = "Navio PWM pins as GPIO",
     .base = GPIO_CHIP_OFFSET + GPIO_PIN_OFFSET,
     .ngpio = RCIO_PWM_MAX_CHANNELS - GPIO_PIN_OFFSET,
+    .can_sleep = true, /* every access is an SPI transaction */
 };
 
-bool rcio_gpio_force_update(struct rcio_state *state) {
-    uint16_t result = gpio.rcio->register_set(gpio.rcio, PX4IO_PAGE_GPIO, 0, &(gpio.pin_states[0]), RCIO_PWM_MAX_CHANNELS);
-    if (result < 0) update_enqueue;
-    return (result >= 0);
+static void gpio_raise_edges(uint16_t previous, uint16_t levels) {
+    unsigned long rising = (levels & ~previous) & (gpio.irq_enabled & gpio.irq_rising);
+    unsigned long falling = (~levels & previous) & (gpio.irq_enabled & gpio.irq_falling);
+    unsigned long edges = rising | falling;
+    unsigned int hwirq;
 
+    for_each_set_bit(hwirq, &edges, RCIO_PWM_MAX_CHANNELS) {
+        unsigned int irq = irq_find_mapping(gpio.domain, hwirq);
+
+        if (irq) {
+            handle_nested_irq(irq);
+        }
+    }
+}
+
+static bool gpio_sample_inputs(struct rcio_state *state) {
+    uint16_t pin_states[RCIO_PWM_MAX_CHANNELS];
+    uint16_t levels = 0, previous = gpio.levels;
+    bool inputs = false;
+
+    if (time_before(jiffies, gpio.sample_timeout)) return true;
+    gpio.sample_timeout = jiffies + gpio_sample_period();
+
+    for (int i = 0; i < RCIO_PWM_MAX_CHANNELS; i++) {
+        if (PX4IO_GPIO_GET_PIN_GPIO_ENABLED(gpio.pin_states[i]) &&
+                PX4IO_GPIO_GET_PIN_DIRECTION(gpio.pin_states[i]) == PX4IO_GPIO_PIN_DIRECTION_INPUT) {
+            inputs = true;
+            break;
+        }
+    }
+
+    /* nobody to sample for, a reader coming back reads the IO directly once and restarts sampling */
+    if ((!inputs || !gpio_levels_wanted()) && !gpio.irq_enabled) {
+        gpio.levels_valid = false;
+        return true;
+    }
+
+    if (state->register_get(state, PX4IO_PAGE_GPIO, 0, pin_states, RCIO_PWM_MAX_CHANNELS) < 0) {
+        return false;
+    }
+
+    for (int i = 0; i < RCIO_PWM_MAX_CHANNELS; i++) {
+        if (PX4IO_GPIO_GET_PIN_STATE(pin_states[i])) levels |= 1 << i;
+    }
+
+    WRITE_ONCE(gpio.levels, levels);
+    gpio.sampled = jiffies;
+
+    if (gpio.levels_valid) {
+        gpio_raise_edges(previous, levels);
+    }
+    gpio.levels_valid = true;
+
+    return true;
 }
 
 bool rcio_gpio_update(struct rcio_state *state)
 {
-    int result = 1;
+    int result;
     if (!gpio_supported) return true;
 
-    if (update_required) {
-        update_dequeue;
-        result = rcio_gpio_force_update(state);
+    result = gpio_flush(state);
+
+    if (!gpio_sample_inputs(state)) return false;
+
+    /* a failed verification just leaves the snapshot aging, the link supervisor deals with a dead IO */
+    if (time_before(jiffies, READ_ONCE(gpio.status_read) + RCIO_GPIO_STATUS_READER_TIMEOUT) &&
+            !time_before(jiffies, gpio.verify_timeout)) {
+        gpio.verify_timeout = jiffies + RCIO_GPIO_VERIFY_PERIOD;
+        gpio_verify(state);
     }
+
     return (result >= 0);
 }
 
+static int gpio_waveform_apply(struct rcio_state *state, uint16_t *pin_states,
+        const struct rcio_gpio_waveform_step *step)
+{
+    unsigned long mask = step->mask;
+    unsigned first = find_first_bit(&mask, RCIO_PWM_MAX_CHANNELS);
+    unsigned last = find_last_bit(&mask, RCIO_PWM_MAX_CHANNELS);
+    unsigned pin;
+
+    /* the pins were outputs when the waveform was queued, they may have been freed or turned around since */
+    for_each_set_bit(pin, &mask, RCIO_PWM_MAX_CHANNELS) {
+        if (!(READ_ONCE(gpio.exported) & (1 << pin)) || !PX4IO_GPIO_GET_PIN_GPIO_ENABLED(pin_states[pin]) ||
+                PX4IO_GPIO_GET_PIN_DIRECTION(pin_states[pin]) != PX4IO_GPIO_PIN_DIRECTION_OUTPUT) {
+            return -EPERM;
+        }
+    }
+
+    for_each_set_bit(pin, &mask, RCIO_PWM_MAX_CHANNELS) {
+        if (step->value & (1 << pin)) {
+            PX4IO_GPIO_SET_PIN_STATE_HIGH(pin_states[pin]);
+        } else {
+            PX4IO_GPIO_SET_PIN_STATE_LOW(pin_states[pin]);
+        }
+    }
+
+    return state->register_set(state, PX4IO_PAGE_GPIO, first, &pin_states[first], last - first + 1);
+}
+
+/* plays steps out on pin_states, noting in emitted_us when each went out relative to the first */
+static int gpio_waveform_run(struct rcio_state *state, uint16_t *pin_states,
+        const struct rcio_gpio_waveform_step *steps, int count, s64 *emitted_us)
+{
+    ktime_t start = ktime_get();
+    ktime_t deadline = start;
+
+    for (int i = 0; i < count && !READ_ONCE(waveform.cancel); i++) {
+        int ret = gpio_waveform_apply(state, pin_states, &steps[i]);
+
+        if (ret < 0) {
+            rcio_gpio_err(state->adapter->dev, "waveform aborted at step %d: %d\n", i, ret);
+            return ret;
+        }
+
+        emitted_us[i] = ktime_to_us(ktime_sub(ktime_get(), start));
+
+        /* absolute deadlines, so lateness of one step does not add up */
+        deadline = ktime_add_us(deadline, steps[i].duration_us);
+        while (!READ_ONCE(waveform.cancel) && ktime_before(ktime_get(), deadline)) {
+            set_current_state(TASK_INTERRUPTIBLE);
+            schedule_hrtimeout_range(&deadline, 0, HRTIMER_MODE_ABS);
+        }
+    }
+
+    return READ_ONCE(waveform.cancel) ? -ECANCELED : 0;
+}
+
+static int gpio_waveform_thread(void *data)
+{
+    struct rcio_state *state = data;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(waveform.wait, waveform.pending || kthread_should_stop());
+
+        if (kthread_should_stop()) break;
+
+        mutex_lock(&waveform.lock);
+        waveform.pending = false;
+        waveform.running = true;
+        mutex_unlock(&waveform.lock);
+
+        waveform.error = gpio_waveform_run(state, gpio.pin_states, waveform.steps, waveform.count,
+                waveform.emitted_us);
+
+        mutex_lock(&waveform.lock);
+        waveform.running = false;
+        mutex_unlock(&waveform.lock);
+    }
+
+    return 0;
+}
+
+/* anything here that needs the worker loops at full rate */
+bool rcio_gpio_busy(void)
+{
+    if (!gpio_supported) return false;
+
+    return READ_ONCE(gpio.dirty) != 0 || READ_ONCE(gpio.irq_enabled) != 0 || gpio_levels_wanted() ||
+            READ_ONCE(waveform.pending) || READ_ONCE(waveform.running);
+}
+
+int rcio_gpio_restore(struct rcio_state *state)
+{
+    int ret;
+
+    if (!gpio_supported) return 0;
+
+    ret = state->register_set(state, PX4IO_PAGE_GPIO_EXPORTED, 0, &gpio.exported, 1);
+    if (ret < 0) return ret;
+
+    return state->register_set(state, PX4IO_PAGE_GPIO, 0, &(gpio.pin_states[0]), RCIO_PWM_MAX_CHANNELS);
+}
+
+static void gpio_domain_remove(void)
+{
+    if (gpio.domain == NULL) return;
+
+    for (int i = 0; i < RCIO_PWM_MAX_CHANNELS; i++) {
+        unsigned int irq = irq_find_mapping(gpio.domain, i);
+
+        if (irq) {
+            irq_dispose_mapping(irq);
+        }
+    }
+
+    irq_domain_remove(gpio.domain);
+    gpio.domain = NULL;
+}
+
 int rcio_gpio_probe(struct rcio_state *state)
 {
     int write_result;
@@ -330,11 +934,45 @@ int rcio_gpio_probe(struct rcio_state *state)
     }
 
     gpio.rcio = state;
+    gpio.features = setup_features;
+    spin_lock_init(&gpio.status_lock);
+    gpio.status_read = jiffies - RCIO_GPIO_STATUS_READER_TIMEOUT;
+    gpio.sample_rate_hz = 100;
+    gpio.sample_timeout = jiffies;
+    gpio.levels_read = jiffies - RCIO_GPIO_READER_TIMEOUT;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,16,0))
+    gpio.domain = irq_domain_create_linear(dev_fwnode(state->adapter->dev), RCIO_PWM_MAX_CHANNELS,
+            &gpio_irq_domain_ops, &gpio);
+#else
+    gpio.domain = irq_domain_add_linear(state->adapter->dev->of_node, RCIO_PWM_MAX_CHANNELS,
+            &gpio_irq_domain_ops, &gpio);
+#endif
+    if (gpio.domain == NULL) {
+        rcio_gpio_err(state->adapter->dev, "could not create IRQ domain\n");
+        ret = -ENOMEM;
+        goto errout_domain;
+    }
+
+    mutex_init(&waveform.lock);
+    init_waitqueue_head(&waveform.wait);
+    waveform.task = kthread_create(gpio_waveform_thread, state, "rcio_gpio_wave");
+    if (IS_ERR(waveform.task)) {
+        rcio_gpio_err(state->adapter->dev, "could not start waveform thread\n");
+        ret = PTR_ERR(waveform.task);
+        waveform.task = NULL;
+        goto errout_thread;
+    }
+
+    /* step deadlines are only as good as the thread's wakeups, so it runs FIFO like the fast worker */
+    rcio_set_fifo(waveform.task);
+    wake_up_process(waveform.task);
+
     ret = sysfs_create_group(gpio.rcio->object, &attr_group);
 
     if (ret < 0) {
         rcio_gpio_err(state->adapter->dev, "module not registered int sysfs\n");
-        return false;
+        goto errout_sysfs;
     } else {
         rcio_gpio_warn(state->adapter->dev, "registered gpio module\n");
     }
@@ -343,22 +981,41 @@ int rcio_gpio_probe(struct rcio_state *state)
 
     if (ret < 0) {
         rcio_gpio_err(state->adapter->dev, "error while adding gpiochip\n");
-        return false;
+        goto errout_gpiochip;
     } else {
         rcio_gpio_warn(state->adapter->dev, "gpiochip added successfully under gpio%d\n", gpiochip.base);
     }
 
     memset(gpio.pin_states, 0, sizeof(gpio.pin_states));
-    rcio_gpio_force_update(gpio.rcio);
+    gpio_mark_all_dirty();
+    gpio_flush(gpio.rcio);
     write_result = gpio.rcio->register_set(gpio.rcio, PX4IO_PAGE_GPIO_EXPORTED, 0, &gpio_exported, 1);
     if (write_result < 0) {
         rcio_gpio_err(state->adapter->dev, "error during unexporting GPIO\n");
-        return false;
+        ret = write_result;
+        goto errout_unexport;
     }
-    gpio.pin_states_updated = 1;
+    gpio.exported = gpio_exported;
+
+    gpio_verify(gpio.rcio);
+    gpio.verify_timeout = jiffies + RCIO_GPIO_VERIFY_PERIOD;
 
     return true;
 
+/* rcio_gpio_remove is a no-op once gpio_supported is cleared, so undo everything here */
+errout_unexport:
+    gpiochip_remove(&gpiochip);
+errout_gpiochip:
+    sysfs_remove_group(gpio.rcio->object, &attr_group);
+errout_sysfs:
+    kthread_stop(waveform.task);
+    waveform.task = NULL;
+errout_thread:
+    gpio_domain_remove();
+errout_domain:
+    gpio.dirty = 0;
+    gpio_supported = false;
+    return ret;
 }
 
 int rcio_gpio_remove(struct rcio_state *state) {
@@ -368,6 +1025,13 @@ int rcio_gpio_remove(struct rcio_state *state) {
 
     gpiochip_remove(&gpiochip);
 
+    if (waveform.task != NULL) {
+        WRITE_ONCE(waveform.cancel, true);
+        kthread_stop(waveform.task);
+    }
+
+    gpio_domain_remove();
+
     if (ret < 0)
         return ret;
 
@@ -378,6 +1042,13 @@ int rcio_gpio_remove(struct rcio_state *state) {
 EXPORT_SYMBOL_GPL(rcio_gpio_probe);
 EXPORT_SYMBOL_GPL(rcio_gpio_update);
 EXPORT_SYMBOL_GPL(rcio_gpio_remove);
+EXPORT_SYMBOL_GPL(rcio_gpio_restore);
+EXPORT_SYMBOL_GPL(rcio_gpio_busy);
+
+#ifdef CONFIG_RCIO_GPIO_KUNIT_TEST
+#include "rcio_gpio_test.c"
+#endif
+
 MODULE_AUTHOR("Nikita Tomilov <nikita.tomilov@emlid.com>");
 MODULE_DESCRIPTION("RCIO GPIO driver");
 MODULE_LICENSE("GPL v2");
@@ -6,5 +6,7 @@
 int rcio_gpio_probe(struct rcio_state* state);
 bool rcio_gpio_update(struct rcio_state *state);
 bool rcio_gpio_remove(struct rcio_state *state);
+int rcio_gpio_restore(struct rcio_state *state);
+bool rcio_gpio_busy(void);
 
 #endif
@@ -0,0 +1,147 @@
+/*
+ * KUnit tests for the waveform player, built into rcio_gpio.c when
+ * CONFIG_RCIO_GPIO_KUNIT_TEST is set (make RCIO_KUNIT=y). The steps go
+ * out through a fake IO that only notes when each GPIO page write arrived
+ * and which levels it set.
+ */
+#include <kunit/test.h>
+
+/* how late a step may reach the fake IO, generous for a loaded test VM */
+#define RCIO_GPIO_TEST_SLACK_US 1000
+
+struct rcio_gpio_fake {
+    struct rcio_adapter adapter;
+    struct rcio_state state;
+    uint16_t pin_states[RCIO_PWM_MAX_CHANNELS];
+    uint16_t exported;
+
+    int writes;
+    u64 written_ns[RCIO_GPIO_WAVEFORM_MAX_STEPS];
+    uint16_t levels[RCIO_GPIO_WAVEFORM_MAX_STEPS];
+};
+
+static int gpio_fake_register_set(struct rcio_state *state, u8 page, u8 offset, const u16 *values, u8 num_values)
+{
+    struct rcio_gpio_fake *fake = container_of(state, struct rcio_gpio_fake, state);
+    u64 now = ktime_get_ns();
+    uint16_t levels = 0;
+
+    if (page != PX4IO_PAGE_GPIO) return 0;
+
+    if (offset + num_values > RCIO_PWM_MAX_CHANNELS || fake->writes == RCIO_GPIO_WAVEFORM_MAX_STEPS) return -EINVAL;
+
+    for (int i = 0; i < num_values; i++) {
+        if (PX4IO_GPIO_GET_PIN_STATE(values[i])) levels |= 1 << (offset + i);
+    }
+
+    fake->written_ns[fake->writes] = now;
+    fake->levels[fake->writes] = levels;
+    fake->writes++;
+
+    return 0;
+}
+
+static int rcio_gpio_test_init(struct kunit *test)
+{
+    struct rcio_gpio_fake *fake = kunit_kzalloc(test, sizeof(*fake), GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, fake);
+
+    fake->state.adapter = &fake->adapter;
+    fake->state.register_set = gpio_fake_register_set;
+
+    /* pin 0 is an exported output, as the waveform store would have insisted on */
+    PX4IO_GPIO_SET_PIN_GPIO_ENABLE(fake->pin_states[0]);
+    PX4IO_GPIO_SET_PIN_DIRECTION_OUTPUT(fake->pin_states[0]);
+    fake->exported = gpio.exported;
+    gpio.exported = 1;
+
+    WRITE_ONCE(waveform.cancel, false);
+    test->priv = fake;
+
+    return 0;
+}
+
+static void rcio_gpio_test_exit(struct kunit *test)
+{
+    struct rcio_gpio_fake *fake = test->priv;
+
+    gpio.exported = fake->exported;
+}
+
+static void rcio_gpio_test_square_wave(struct kunit *test)
+{
+    static const u32 durations_us[] = { 500, 1000, 2000, 250, 4000, 1000 };
+    const int count = ARRAY_SIZE(durations_us);
+    struct rcio_gpio_fake *fake = test->priv;
+    struct rcio_gpio_waveform_step steps[ARRAY_SIZE(durations_us)];
+    s64 emitted_us[ARRAY_SIZE(durations_us)];
+    s64 target_us = 0;
+
+    for (int i = 0; i < count; i++) {
+        steps[i].mask = 1;
+        steps[i].value = !(i & 1);
+        steps[i].duration_us = durations_us[i];
+    }
+
+    KUNIT_ASSERT_EQ(test, gpio_waveform_run(&fake->state, fake->pin_states, steps, count, emitted_us), 0);
+    KUNIT_ASSERT_EQ(test, fake->writes, count);
+
+    for (int i = 0; i < count; i++) {
+        s64 written_us = div_u64(fake->written_ns[i] - fake->written_ns[0], NSEC_PER_USEC);
+
+        KUNIT_EXPECT_EQ(test, fake->levels[i] & 1, steps[i].value);
+        KUNIT_EXPECT_GE(test, written_us, target_us);
+        KUNIT_EXPECT_LE(test, written_us, target_us + RCIO_GPIO_TEST_SLACK_US);
+        target_us += durations_us[i];
+    }
+}
+
+/* a pin turned into an input after the waveform was queued stops the playback instead of being driven */
+static void rcio_gpio_test_pin_turned_input(struct kunit *test)
+{
+    struct rcio_gpio_fake *fake = test->priv;
+    struct rcio_gpio_waveform_step steps[] = {
+        { .mask = 1, .value = 1, .duration_us = 100 },
+        { .mask = 1, .value = 0, .duration_us = 100 },
+    };
+    s64 emitted_us[ARRAY_SIZE(steps)];
+
+    PX4IO_GPIO_SET_PIN_DIRECTION_INPUT(fake->pin_states[0]);
+
+    KUNIT_EXPECT_EQ(test, gpio_waveform_run(&fake->state, fake->pin_states, steps, ARRAY_SIZE(steps), emitted_us),
+            -EPERM);
+    KUNIT_EXPECT_EQ(test, fake->writes, 0);
+}
+
+/* same for a pin that is no longer exported */
+static void rcio_gpio_test_pin_unexported(struct kunit *test)
+{
+    struct rcio_gpio_fake *fake = test->priv;
+    struct rcio_gpio_waveform_step steps[] = {
+        { .mask = 1, .value = 1, .duration_us = 100 },
+    };
+    s64 emitted_us[ARRAY_SIZE(steps)];
+
+    gpio.exported = 0;
+
+    KUNIT_EXPECT_EQ(test, gpio_waveform_run(&fake->state, fake->pin_states, steps, ARRAY_SIZE(steps), emitted_us),
+            -EPERM);
+    KUNIT_EXPECT_EQ(test, fake->writes, 0);
+}
+
+static struct kunit_case rcio_gpio_test_cases[] = {
+    KUNIT_CASE(rcio_gpio_test_square_wave),
+    KUNIT_CASE(rcio_gpio_test_pin_turned_input),
+    KUNIT_CASE(rcio_gpio_test_pin_unexported),
+    {}
+};
+
+static struct kunit_suite rcio_gpio_test_suite = {
+    .name = "rcio_gpio_waveform",
+    .init = rcio_gpio_test_init,
+    .exit = rcio_gpio_test_exit,
+    .test_cases = rcio_gpio_test_cases,
+};
+
+kunit_test_suite(rcio_gpio_test_suite);
@@ -0,0 +1,331 @@
+#include <linux/module.h>
+#include <linux/ktime.h>
+#define DEBUG
+#include <linux/device.h>
+
+#include "rcio.h"
+#include "protocol.h"
+
+#define rcio_health_err(__dev, format, args...)\
+        dev_err(__dev, "rcio_health: " format, ##args)
+#define rcio_health_warn(__dev, format, args...)\
+        dev_warn(__dev, "rcio_health: " format, ##args)
+
+#define RCIO_HEALTH_MIN_WINDOW_MS 100
+#define RCIO_HEALTH_MAX_WINDOW_MS 60000
+
+#define RCIO_HEALTH_ALARMS_COUNT 8
+
+typedef enum {
+    METRIC_CPULOAD = 0, METRIC_FREEMEM, METRIC_VBATT, METRIC_IBATT, METRIC_VSERVO, METRIC_VRSSI, METRIC_PRSSI,
+    METRICS_COUNT
+} health_metric_t;
+
+static const char *alarm_names[RCIO_HEALTH_ALARMS_COUNT] = {
+    "vbatt_low", "temperature", "servo_current", "acc_current",
+    "fmu_lost", "rc_lost", "pwm_error", "vservo_fault",
+};
+
+/*
+ * Running statistics are collected over a tumbling window of window_ms,
+ * the last complete window is what sysfs shows.
+ */
+struct rcio_health_metric {
+    u16 current_value;
+    u16 min;
+    u16 max;
+    u32 sum;
+    u32 count;
+
+    u16 window_min;
+    u16 window_max;
+    u16 window_avg;
+};
+
+struct rcio_health_alarm {
+    u32 count;
+    u64 first_ns;
+    u64 last_ns;
+};
+
+static struct rcio_health {
+    struct rcio_state *rcio;
+    spinlock_t lock;
+
+    unsigned long last_sample;
+    unsigned long window_end;
+    unsigned int window_ms;
+
+    struct rcio_health_metric metrics[METRICS_COUNT];
+
+    u16 alarms;
+    u16 latched_alarms;
+    struct rcio_health_alarm alarm_history[RCIO_HEALTH_ALARMS_COUNT];
+} health;
+
+bool rcio_health_update(struct rcio_state *state);
+
+static ssize_t metric_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+
+static ssize_t window_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", health.window_ms);
+}
+
+static ssize_t window_ms_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int value;
+
+    if (kstrtouint(buf, 10, &value) < 0 || value < RCIO_HEALTH_MIN_WINDOW_MS || value > RCIO_HEALTH_MAX_WINDOW_MS) {
+        rcio_health_err(health.rcio->adapter->dev, "Invalid value for window_ms, this should be from %d to %d\n",
+                RCIO_HEALTH_MIN_WINDOW_MS, RCIO_HEALTH_MAX_WINDOW_MS);
+        return -EINVAL;
+    }
+
+    spin_lock(&health.lock);
+    health.window_ms = value;
+    health.window_end = jiffies + msecs_to_jiffies(value);
+    spin_unlock(&health.lock);
+
+    return count;
+}
+
+static ssize_t alarms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "0x%x\n", READ_ONCE(health.latched_alarms));
+}
+
+static ssize_t alarms_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned long mask;
+    u16 clear;
+
+    if (kstrtoul(buf, 16, &mask) < 0 || mask > 0xff) {
+        rcio_health_err(health.rcio->adapter->dev, "Invalid value for alarms, this should be from 0x0 to 0xff\n");
+        return -EINVAL;
+    }
+
+    /*
+     * IO latches alarms as well, writing 1 to a bit clears it there. It goes
+     * first, so a failed write leaves the host side showing what is still
+     * latched on the IO.
+     */
+    clear = mask;
+    if (health.rcio->register_set(health.rcio, PX4IO_PAGE_STATUS, PX4IO_P_STATUS_ALARMS, &clear, 1) < 0) {
+        rcio_health_err(health.rcio->adapter->dev, "Could not clear IO alarms 0x%x\n", clear);
+        return -EIO;
+    }
+
+    spin_lock(&health.lock);
+    health.latched_alarms &= ~mask;
+    for (int i = 0; i < RCIO_HEALTH_ALARMS_COUNT; i++) {
+        if (mask & (1 << i)) {
+            memset(&health.alarm_history[i], 0, sizeof(health.alarm_history[i]));
+        }
+    }
+    spin_unlock(&health.lock);
+
+    return count;
+}
+
+static ssize_t alarm_history_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct rcio_health_alarm history[RCIO_HEALTH_ALARMS_COUNT];
+    u16 latched;
+    ssize_t len = 0;
+
+    spin_lock(&health.lock);
+    memcpy(history, health.alarm_history, sizeof(history));
+    latched = health.latched_alarms;
+    spin_unlock(&health.lock);
+
+    /* name latched count first_ms last_ms, timestamps are CLOCK_MONOTONIC */
+    for (int i = 0; i < RCIO_HEALTH_ALARMS_COUNT; i++) {
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s %d %u %llu %llu\n", alarm_names[i],
+                (latched >> i) & 1, history[i].count,
+                div_u64(history[i].first_ns, NSEC_PER_MSEC), div_u64(history[i].last_ns, NSEC_PER_MSEC));
+    }
+
+    return len;
+}
+
+#define HEALTH_METRIC_ATTR(metric) __ATTR(metric, S_IRUGO, metric_show, NULL)
+
+static struct kobj_attribute cpuload_attribute = HEALTH_METRIC_ATTR(cpuload);
+static struct kobj_attribute freemem_attribute = HEALTH_METRIC_ATTR(freemem);
+static struct kobj_attribute vbatt_attribute = HEALTH_METRIC_ATTR(vbatt);
+static struct kobj_attribute ibatt_attribute = HEALTH_METRIC_ATTR(ibatt);
+static struct kobj_attribute vservo_attribute = HEALTH_METRIC_ATTR(vservo);
+static struct kobj_attribute vrssi_attribute = HEALTH_METRIC_ATTR(vrssi);
+static struct kobj_attribute prssi_attribute = HEALTH_METRIC_ATTR(prssi);
+
+static struct kobj_attribute window_ms_attribute = __ATTR_RW(window_ms);
+static struct kobj_attribute alarms_attribute = __ATTR_RW(alarms);
+static struct kobj_attribute alarm_history_attribute = __ATTR_RO(alarm_history);
+
+static struct kobj_attribute *metric_attributes[METRICS_COUNT] = {
+    [METRIC_CPULOAD] = &cpuload_attribute,
+    [METRIC_FREEMEM] = &freemem_attribute,
+    [METRIC_VBATT] = &vbatt_attribute,
+    [METRIC_IBATT] = &ibatt_attribute,
+    [METRIC_VSERVO] = &vservo_attribute,
+    [METRIC_VRSSI] = &vrssi_attribute,
+    [METRIC_PRSSI] = &prssi_attribute,
+};
+
+static ssize_t metric_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct rcio_health_metric metric;
+
+    for (int i = 0; i < METRICS_COUNT; i++) {
+        if (metric_attributes[i] == attr) {
+            spin_lock(&health.lock);
+            metric = health.metrics[i];
+            spin_unlock(&health.lock);
+
+            /* current, then min max avg over the last complete window */
+            return sprintf(buf, "%u %u %u %u\n", metric.current_value,
+                    metric.window_min, metric.window_max, metric.window_avg);
+        }
+    }
+
+    return -EIO;
+}
+
+static struct attribute *attrs[] = {
+    &cpuload_attribute.attr,
+    &freemem_attribute.attr,
+    &vbatt_attribute.attr,
+    &ibatt_attribute.attr,
+    &vservo_attribute.attr,
+    &vrssi_attribute.attr,
+    &prssi_attribute.attr,
+    &window_ms_attribute.attr,
+    &alarms_attribute.attr,
+    &alarm_history_attribute.attr,
+    NULL,
+};
+
+static struct attribute_group attr_group = {
+    .name = "health",
+    .attrs = attrs,
+};
+
+static void rcio_health_metric_reset(struct rcio_health_metric *metric)
+{
+    metric->min = U16_MAX;
+    metric->max = 0;
+    metric->sum = 0;
+    metric->count = 0;
+}
+
+static void rcio_health_metric_sample(struct rcio_health_metric *metric, u16 value)
+{
+    metric->current_value = value;
+    metric->min = min(metric->min, value);
+    metric->max = max(metric->max, value);
+    metric->sum += value;
+    metric->count++;
+}
+
+static void rcio_health_metric_publish(struct rcio_health_metric *metric)
+{
+    if (metric->count > 0) {
+        metric->window_min = metric->min;
+        metric->window_max = metric->max;
+        metric->window_avg = metric->sum / metric->count;
+    }
+
+    rcio_health_metric_reset(metric);
+}
+
+static void rcio_health_latch_alarms(u16 alarms)
+{
+    u16 raised = alarms & ~health.alarms;
+    u64 now = ktime_get_ns();
+
+    for (int i = 0; i < RCIO_HEALTH_ALARMS_COUNT; i++) {
+        if (!(alarms & (1 << i))) {
+            continue;
+        }
+
+        if (!(health.latched_alarms & (1 << i))) {
+            health.alarm_history[i].first_ns = now;
+        }
+
+        if (raised & (1 << i)) {
+            health.alarm_history[i].count++;
+        }
+
+        health.alarm_history[i].last_ns = now;
+    }
+
+    health.latched_alarms |= alarms;
+    health.alarms = alarms;
+}
+
+bool rcio_health_update(struct rcio_state *state)
+{
+    struct rcio_io_status io_status;
+
+    /* sample every fresh status page fetched by the core exactly once */
+    if (!state->status_get(state, &io_status) || io_status.timestamp == health.last_sample) {
+        return false;
+    }
+
+    health.last_sample = io_status.timestamp;
+
+    spin_lock(&health.lock);
+
+    rcio_health_metric_sample(&health.metrics[METRIC_CPULOAD], io_status.cpuload);
+    rcio_health_metric_sample(&health.metrics[METRIC_FREEMEM], io_status.freemem);
+    rcio_health_metric_sample(&health.metrics[METRIC_VBATT], io_status.vbatt);
+    rcio_health_metric_sample(&health.metrics[METRIC_IBATT], io_status.ibatt);
+    rcio_health_metric_sample(&health.metrics[METRIC_VSERVO], io_status.vservo);
+    rcio_health_metric_sample(&health.metrics[METRIC_VRSSI], io_status.vrssi);
+    rcio_health_metric_sample(&health.metrics[METRIC_PRSSI], io_status.prssi);
+
+    if (time_after_eq(jiffies, health.window_end)) {
+        for (int i = 0; i < METRICS_COUNT; i++) {
+            rcio_health_metric_publish(&health.metrics[i]);
+        }
+        health.window_end = jiffies + msecs_to_jiffies(health.window_ms);
+    }
+
+    rcio_health_latch_alarms(io_status.alarms);
+
+    spin_unlock(&health.lock);
+
+    return true;
+}
+
+int rcio_health_probe(struct rcio_state *state)
+{
+    int ret;
+
+    health.rcio = state;
+
+    spin_lock_init(&health.lock);
+
+    health.window_ms = 1000;
+    health.window_end = jiffies + msecs_to_jiffies(health.window_ms);
+
+    for (int i = 0; i < METRICS_COUNT; i++) {
+        rcio_health_metric_reset(&health.metrics[i]);
+    }
+
+    ret = sysfs_create_group(health.rcio->object, &attr_group);
+
+    if (ret < 0) {
+        rcio_health_err(state->adapter->dev, "module not registered int sysfs\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+EXPORT_SYMBOL_GPL(rcio_health_probe);
+EXPORT_SYMBOL_GPL(rcio_health_update);
+MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
+MODULE_DESCRIPTION("RCIO health telemetry driver");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,9 @@
+#ifndef _RCIO_HEALTH_H
+#define _RCIO_HEALTH_H
+
+#include "rcio.h"
+
+int rcio_health_probe(struct rcio_state *state);
+bool rcio_health_update(struct rcio_state *state);
+
+#endif
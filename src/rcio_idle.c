@@ -0,0 +1,292 @@
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#define DEBUG
+#include <linux/device.h>
+
+#include "rcio.h"
+#include "rcio_gpio.h"
+#include "rcio_link.h"
+#include "rcio_pwm.h"
+#include "rcio_safety.h"
+#include "rcio_telemetry.h"
+#include "rcio_idle.h"
+
+#define rcio_idle_err(__dev, format, args...)\
+        dev_err(__dev, "rcio_idle: " format, ##args)
+
+#define RCIO_IDLE_ACTIVE_SLEEP_US 1000
+#define RCIO_IDLE_ACTIVE_SLACK_US 500
+
+#define RCIO_IDLE_MIN_PERIOD_MS 5
+#define RCIO_IDLE_MAX_PERIOD_MS 1000
+#define RCIO_IDLE_MIN_GRACE_MS 100
+#define RCIO_IDLE_MAX_GRACE_MS 60000
+
+/*
+ * With the outputs disarmed, nobody holding /dev/rcio open, no sysfs reads
+ * of RC or ADC for grace_ms and no GPIO work, the worker loops drop from
+ * ~1 kHz to one pass every period_ms. The period is capped at half the
+ * heartbeat period and half the link deadline, so neither the IO watchdog
+ * nor the link supervisor notice. Any consumer calls rcio_idle_kick(),
+ * which brings the loops back to full rate right away; the time that takes
+ * is the exit latency.
+ */
+static struct rcio_idle {
+    struct rcio_state *rcio;
+    wait_queue_head_t wait;
+
+    bool enabled;
+    bool idle;
+    unsigned int period_ms;
+    unsigned int grace_ms;
+    unsigned long last_busy;
+    u64 kick_ns;
+    u64 entered_ns;
+
+    unsigned int entries;
+    unsigned int exits;
+    unsigned int last_entry_ms;
+    unsigned int last_exit_us;
+    unsigned int max_exit_us;
+    u64 idle_ns;
+} idle;
+
+static const char *idle_state_names[] = { "active", "idle" };
+
+static unsigned int rcio_idle_period_ms(void)
+{
+    unsigned int period_ms = READ_ONCE(idle.period_ms);
+
+    period_ms = min(period_ms, rcio_safety_heartbeat_period_ms() / 2);
+    period_ms = min(period_ms, rcio_link_deadline_ms() / 2);
+
+    return max(period_ms, 1U);
+}
+
+static ssize_t enabled_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", idle.enabled);
+}
+
+static ssize_t enabled_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    bool value;
+
+    if (kstrtobool(buf, &value) < 0) {
+        rcio_idle_err(idle.rcio->adapter->dev, "Invalid value for enabled, this should be 0 or 1\n");
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(idle.enabled, value);
+
+    if (!value) {
+        rcio_idle_kick();
+    }
+
+    return count;
+}
+
+static ssize_t period_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    /* configured, then what is actually used */
+    return sprintf(buf, "%u %u\n", idle.period_ms, rcio_idle_period_ms());
+}
+
+static ssize_t period_ms_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int value;
+
+    if (kstrtouint(buf, 10, &value) < 0 || value < RCIO_IDLE_MIN_PERIOD_MS || value > RCIO_IDLE_MAX_PERIOD_MS) {
+        rcio_idle_err(idle.rcio->adapter->dev, "Invalid value for period_ms, this should be from %d to %d\n",
+                RCIO_IDLE_MIN_PERIOD_MS, RCIO_IDLE_MAX_PERIOD_MS);
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(idle.period_ms, value);
+
+    return count;
+}
+
+static ssize_t grace_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", idle.grace_ms);
+}
+
+static ssize_t grace_ms_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int value;
+
+    if (kstrtouint(buf, 10, &value) < 0 || value < RCIO_IDLE_MIN_GRACE_MS || value > RCIO_IDLE_MAX_GRACE_MS) {
+        rcio_idle_err(idle.rcio->adapter->dev, "Invalid value for grace_ms, this should be from %d to %d\n",
+                RCIO_IDLE_MIN_GRACE_MS, RCIO_IDLE_MAX_GRACE_MS);
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(idle.grace_ms, value);
+
+    return count;
+}
+
+static ssize_t state_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%s\n", idle_state_names[READ_ONCE(idle.idle)]);
+}
+
+static ssize_t stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    u64 idle_ns = idle.idle_ns;
+
+    if (READ_ONCE(idle.idle)) {
+        idle_ns += ktime_get_ns() - idle.entered_ns;
+    }
+
+    return sprintf(buf, "entries: %u\nexits: %u\nlast_entry_ms: %u\nlast_exit_us: %u\nmax_exit_us: %u\nidle_ms: %llu\n",
+            idle.entries, idle.exits, idle.last_entry_ms, idle.last_exit_us, idle.max_exit_us,
+            div_u64(idle_ns, NSEC_PER_MSEC));
+}
+
+static ssize_t stats_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    idle.entries = 0;
+    idle.exits = 0;
+    idle.last_entry_ms = 0;
+    idle.last_exit_us = 0;
+    idle.max_exit_us = 0;
+    idle.idle_ns = 0;
+
+    return count;
+}
+
+static struct kobj_attribute enabled_attribute = __ATTR_RW(enabled);
+static struct kobj_attribute period_ms_attribute = __ATTR_RW(period_ms);
+static struct kobj_attribute grace_ms_attribute = __ATTR_RW(grace_ms);
+static struct kobj_attribute state_attribute = __ATTR_RO(state);
+static struct kobj_attribute stats_attribute = __ATTR_RW(stats);
+
+static struct attribute *attrs[] = {
+    &enabled_attribute.attr,
+    &period_ms_attribute.attr,
+    &grace_ms_attribute.attr,
+    &state_attribute.attr,
+    &stats_attribute.attr,
+    NULL,
+};
+
+static struct attribute_group attr_group = {
+    .name = "idle",
+    .attrs = attrs,
+};
+
+/* cheap enough for any context, it only records the time and wakes the loops */
+void rcio_idle_kick(void)
+{
+    WRITE_ONCE(idle.last_busy, jiffies);
+
+    if (READ_ONCE(idle.idle)) {
+        cmpxchg(&idle.kick_ns, 0, ktime_get_ns());
+        wake_up_all(&idle.wait);
+    }
+}
+
+static bool rcio_idle_has_consumers(void)
+{
+    return rcio_pwm_armed() || rcio_telemetry_has_readers() || rcio_gpio_busy();
+}
+
+static void rcio_idle_exit(u64 now)
+{
+    u64 kick_ns = xchg(&idle.kick_ns, 0);
+
+    idle.idle_ns += now - idle.entered_ns;
+    idle.exits++;
+
+    if (kick_ns != 0) {
+        idle.last_exit_us = div_u64(now - kick_ns, NSEC_PER_USEC);
+        idle.max_exit_us = max(idle.max_exit_us, idle.last_exit_us);
+    }
+
+    WRITE_ONCE(idle.idle, false);
+    wake_up_all(&idle.wait);
+}
+
+/* called once per pass of the fast loop */
+void rcio_idle_update(struct rcio_state *state)
+{
+    u64 now = ktime_get_ns();
+
+    if (rcio_idle_has_consumers()) {
+        WRITE_ONCE(idle.last_busy, jiffies);
+    }
+
+    if (idle.idle) {
+        if (READ_ONCE(idle.kick_ns) != 0 || !READ_ONCE(idle.enabled) ||
+                time_after(READ_ONCE(idle.last_busy), jiffies - msecs_to_jiffies(READ_ONCE(idle.grace_ms)))) {
+            rcio_idle_exit(now);
+        }
+        return;
+    }
+
+    if (READ_ONCE(idle.enabled) && time_after(jiffies, READ_ONCE(idle.last_busy) + msecs_to_jiffies(READ_ONCE(idle.grace_ms)))) {
+        idle.last_entry_ms = jiffies_to_msecs(jiffies - READ_ONCE(idle.last_busy));
+        idle.entered_ns = now;
+        idle.entries++;
+        WRITE_ONCE(idle.idle, true);
+    }
+}
+
+/* how long the next rcio_idle_sleep() is meant to take, slack aside */
+unsigned int rcio_idle_sleep_us(void)
+{
+    if (!READ_ONCE(idle.idle)) {
+        return RCIO_IDLE_ACTIVE_SLEEP_US;
+    }
+
+    return rcio_idle_period_ms() * USEC_PER_MSEC;
+}
+
+void rcio_idle_sleep(void)
+{
+    if (!READ_ONCE(idle.idle)) {
+        usleep_range(RCIO_IDLE_ACTIVE_SLEEP_US, RCIO_IDLE_ACTIVE_SLEEP_US + RCIO_IDLE_ACTIVE_SLACK_US);
+        return;
+    }
+
+    wait_event_interruptible_timeout(idle.wait,
+            READ_ONCE(idle.kick_ns) != 0 || !READ_ONCE(idle.idle) || kthread_should_stop(),
+            msecs_to_jiffies(rcio_idle_period_ms()));
+}
+
+int rcio_idle_probe(struct rcio_state *state)
+{
+    int ret;
+
+    idle.rcio = state;
+
+    init_waitqueue_head(&idle.wait);
+
+    idle.enabled = true;
+    idle.idle = false;
+    idle.period_ms = 20;
+    idle.grace_ms = 2000;
+    idle.last_busy = jiffies;
+
+    ret = sysfs_create_group(idle.rcio->object, &attr_group);
+
+    if (ret < 0) {
+        rcio_idle_err(state->adapter->dev, "module not registered int sysfs\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+EXPORT_SYMBOL_GPL(rcio_idle_probe);
+EXPORT_SYMBOL_GPL(rcio_idle_update);
+EXPORT_SYMBOL_GPL(rcio_idle_sleep);
+EXPORT_SYMBOL_GPL(rcio_idle_sleep_us);
+EXPORT_SYMBOL_GPL(rcio_idle_kick);
+MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
+MODULE_DESCRIPTION("RCIO idle mode");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,12 @@
+#ifndef _RCIO_IDLE_H
+#define _RCIO_IDLE_H
+
+#include "rcio.h"
+
+int rcio_idle_probe(struct rcio_state *state);
+void rcio_idle_update(struct rcio_state *state);
+void rcio_idle_sleep(void);
+unsigned int rcio_idle_sleep_us(void);
+void rcio_idle_kick(void);
+
+#endif
@@ -0,0 +1,163 @@
+#include <linux/module.h>
+#include <linux/device.h>
+#include <linux/jiffies.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+
+#include "rcio.h"
+#include "rcio_lazy.h"
+#include "rcio_telemetry.h"
+
+#define RCIO_LAZY_MAX_AGE_MS 60000
+
+void rcio_lazy_init(struct rcio_lazy *lazy, struct rcio_state *state, bool (*refresh)(struct rcio_state *state),
+        unsigned int max_age_ms)
+{
+    mutex_init(&lazy->lock);
+    lazy->state = state;
+    lazy->refresh = refresh;
+    lazy->policy = RCIO_POLICY_PERIODIC;
+    lazy->max_age_ms = max_age_ms;
+    lazy->lazy_poll_ms = 0;
+    lazy->valid = false;
+    lazy->refreshes = 0;
+    lazy->shared = 0;
+}
+
+static void rcio_lazy_refreshed(struct rcio_lazy *lazy)
+{
+    WRITE_ONCE(lazy->updated, jiffies);
+    WRITE_ONCE(lazy->valid, true);
+}
+
+static bool rcio_lazy_fresh(struct rcio_lazy *lazy)
+{
+    return READ_ONCE(lazy->valid) &&
+        time_before_eq(jiffies, READ_ONCE(lazy->updated) + msecs_to_jiffies(READ_ONCE(lazy->max_age_ms)));
+}
+
+/* background polling from the worker, period is what the periodic policy uses */
+bool rcio_lazy_poll(struct rcio_lazy *lazy, unsigned long *timeout, unsigned long period)
+{
+    bool updated;
+
+    if (time_before(jiffies, *timeout)) {
+        return false;
+    }
+
+    /*
+     * /dev/rcio readers take the values straight from the published
+     * records and never come through rcio_lazy_get, so while there are any
+     * the subsystem polls as if it were periodic.
+     */
+    if (READ_ONCE(lazy->policy) == RCIO_POLICY_LAZY && !rcio_telemetry_has_readers()) {
+        unsigned int lazy_poll_ms = READ_ONCE(lazy->lazy_poll_ms);
+
+        if (lazy_poll_ms == 0) {
+            *timeout = jiffies + period;
+            return false;
+        }
+
+        period = msecs_to_jiffies(lazy_poll_ms);
+    }
+
+    /* a reader is refreshing right now, no point in doing it twice */
+    if (!mutex_trylock(&lazy->lock)) {
+        return false;
+    }
+
+    updated = lazy->refresh(lazy->state);
+    if (updated) {
+        rcio_lazy_refreshed(lazy);
+        *timeout = jiffies + period;
+    }
+
+    mutex_unlock(&lazy->lock);
+
+    return updated;
+}
+
+/* makes sure the values are within max_age_ms before a reader looks at them */
+int rcio_lazy_get(struct rcio_lazy *lazy)
+{
+    int ret = 0;
+
+    if (rcio_lazy_fresh(lazy)) {
+        return 0;
+    }
+
+    if (mutex_lock_interruptible(&lazy->lock)) {
+        return -ERESTARTSYS;
+    }
+
+    if (rcio_lazy_fresh(lazy)) {
+        lazy->shared++;
+    } else if (lazy->refresh(lazy->state)) {
+        rcio_lazy_refreshed(lazy);
+        lazy->refreshes++;
+    } else {
+        ret = -EIO;
+    }
+
+    mutex_unlock(&lazy->lock);
+
+    return ret;
+}
+
+ssize_t rcio_lazy_attr_show(struct rcio_lazy *lazy, const char *name, char *buf)
+{
+    if (!strcmp(name, "policy")) {
+        return sprintf(buf, "%s\n", lazy->policy == RCIO_POLICY_LAZY ? "lazy" : "periodic");
+    } else if (!strcmp(name, "max_age_ms")) {
+        return sprintf(buf, "%u\n", lazy->max_age_ms);
+    } else if (!strcmp(name, "lazy_poll_ms")) {
+        return sprintf(buf, "%u\n", lazy->lazy_poll_ms);
+    } else if (!strcmp(name, "refreshes")) {
+        /* synchronous refreshes, then readers that shared somebody else's */
+        return sprintf(buf, "%u %u\n", lazy->refreshes, lazy->shared);
+    }
+
+    return -EIO;
+}
+
+ssize_t rcio_lazy_attr_store(struct rcio_lazy *lazy, const char *name, const char *buf, size_t count)
+{
+    struct device *dev = lazy->state->adapter->dev;
+    unsigned int value;
+
+    if (!strcmp(name, "policy")) {
+        if (sysfs_streq(buf, "lazy")) {
+            WRITE_ONCE(lazy->policy, RCIO_POLICY_LAZY);
+        } else if (sysfs_streq(buf, "periodic")) {
+            WRITE_ONCE(lazy->policy, RCIO_POLICY_PERIODIC);
+        } else {
+            dev_err(dev, "rcio: Invalid value for policy, this should be periodic or lazy\n");
+            return -EINVAL;
+        }
+    } else if (!strcmp(name, "max_age_ms")) {
+        if (kstrtouint(buf, 10, &value) < 0 || value < 1 || value > RCIO_LAZY_MAX_AGE_MS) {
+            dev_err(dev, "rcio: Invalid value for max_age_ms, this should be from 1 to %d\n", RCIO_LAZY_MAX_AGE_MS);
+            return -EINVAL;
+        }
+        WRITE_ONCE(lazy->max_age_ms, value);
+    } else if (!strcmp(name, "lazy_poll_ms")) {
+        if (kstrtouint(buf, 10, &value) < 0 || value > RCIO_LAZY_MAX_AGE_MS) {
+            dev_err(dev, "rcio: Invalid value for lazy_poll_ms, this should be from 0 to %d\n", RCIO_LAZY_MAX_AGE_MS);
+            return -EINVAL;
+        }
+        WRITE_ONCE(lazy->lazy_poll_ms, value);
+    } else {
+        return -EIO;
+    }
+
+    return count;
+}
+
+EXPORT_SYMBOL_GPL(rcio_lazy_init);
+EXPORT_SYMBOL_GPL(rcio_lazy_poll);
+EXPORT_SYMBOL_GPL(rcio_lazy_get);
+EXPORT_SYMBOL_GPL(rcio_lazy_attr_show);
+EXPORT_SYMBOL_GPL(rcio_lazy_attr_store);
+MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
+MODULE_DESCRIPTION("RCIO lazy polling");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,41 @@
+#ifndef _RCIO_LAZY_H
+#define _RCIO_LAZY_H
+
+#include "rcio.h"
+
+typedef enum {
+    RCIO_POLICY_PERIODIC = 0, RCIO_POLICY_LAZY
+} rcio_policy_t;
+
+/*
+ * Polling policy of a subsystem whose values are read from sysfs. Periodic
+ * polls on the subsystem's own timer, lazy polls every lazy_poll_ms or not
+ * at all when that is 0, and periodic again while /dev/rcio has readers.
+ * Either way a sysfs reader finding the values older than max_age_ms
+ * refreshes them synchronously, and readers arriving while that refresh
+ * is on the bus wait for it instead of starting their own.
+ */
+struct rcio_lazy
+{
+    struct mutex lock;
+    struct rcio_state *state;
+    bool (*refresh)(struct rcio_state *state);
+
+    rcio_policy_t policy;
+    unsigned int max_age_ms;
+    unsigned int lazy_poll_ms;
+
+    bool valid;
+    unsigned long updated;
+    unsigned int refreshes;
+    unsigned int shared;
+};
+
+void rcio_lazy_init(struct rcio_lazy *lazy, struct rcio_state *state, bool (*refresh)(struct rcio_state *state),
+        unsigned int max_age_ms);
+bool rcio_lazy_poll(struct rcio_lazy *lazy, unsigned long *timeout, unsigned long period);
+int rcio_lazy_get(struct rcio_lazy *lazy);
+ssize_t rcio_lazy_attr_show(struct rcio_lazy *lazy, const char *name, char *buf);
+ssize_t rcio_lazy_attr_store(struct rcio_lazy *lazy, const char *name, const char *buf, size_t count);
+
+#endif
@@ -0,0 +1,219 @@
+#include <linux/module.h>
+#include <linux/ktime.h>
+#define DEBUG
+#include <linux/device.h>
+
+#include "rcio.h"
+#include "protocol.h"
+#include "rcio_gpio.h"
+#include "rcio_pwm.h"
+#include "rcio_safety.h"
+
+#define rcio_link_err(__dev, format, args...)\
+        dev_err(__dev, "rcio_link: " format, ##args)
+#define rcio_link_warn(__dev, format, args...)\
+        dev_warn(__dev, "rcio_link: " format, ##args)
+
+#define RCIO_LINK_MIN_DEADLINE_MS 10
+#define RCIO_LINK_MAX_DEADLINE_MS 5000
+
+typedef enum {
+    LINK_UP = 0, LINK_LOST
+} link_state_t;
+
+static const char *link_state_names[] = {
+    [LINK_UP] = "up",
+    [LINK_LOST] = "lost",
+};
+
+/*
+ * The link is declared lost when no register transaction succeeded for
+ * deadline_ms, or when the IO reports safety on again after we turned it
+ * off (i.e. it has rebooted behind our back). While lost, the IO is
+ * probed every deadline_ms and, once it answers, re-initialised from the
+ * host copies of the PWM and GPIO configuration.
+ */
+static struct rcio_link {
+    struct rcio_state *rcio;
+
+    link_state_t state;
+    unsigned int deadline_ms;
+    unsigned long retry;
+    bool safety_off_seen;
+
+    u64 lost_ns;
+    unsigned int losses;
+    unsigned int resets;
+    unsigned int recoveries;
+    unsigned int last_detect_ms;
+    unsigned int last_recover_ms;
+    unsigned int max_recover_ms;
+} link;
+
+bool rcio_link_update(struct rcio_state *state);
+
+static ssize_t state_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%s\n", link_state_names[READ_ONCE(link.state)]);
+}
+
+static ssize_t deadline_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", link.deadline_ms);
+}
+
+static ssize_t deadline_ms_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int value;
+
+    if (kstrtouint(buf, 10, &value) < 0 || value < RCIO_LINK_MIN_DEADLINE_MS || value > RCIO_LINK_MAX_DEADLINE_MS) {
+        rcio_link_err(link.rcio->adapter->dev, "Invalid value for deadline_ms, this should be from %d to %d\n",
+                RCIO_LINK_MIN_DEADLINE_MS, RCIO_LINK_MAX_DEADLINE_MS);
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(link.deadline_ms, value);
+
+    return count;
+}
+
+static ssize_t stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "losses: %u\nresets: %u\nrecoveries: %u\nlast_detect_ms: %u\nlast_recover_ms: %u\nmax_recover_ms: %u\n",
+            link.losses, link.resets, link.recoveries, link.last_detect_ms, link.last_recover_ms, link.max_recover_ms);
+}
+
+static struct kobj_attribute state_attribute = __ATTR_RO(state);
+static struct kobj_attribute deadline_ms_attribute = __ATTR_RW(deadline_ms);
+static struct kobj_attribute stats_attribute = __ATTR_RO(stats);
+
+static struct attribute *attrs[] = {
+    &state_attribute.attr,
+    &deadline_ms_attribute.attr,
+    &stats_attribute.attr,
+    NULL,
+};
+
+static struct attribute_group attr_group = {
+    .name = "link",
+    .attrs = attrs,
+};
+
+static void rcio_link_set_state(struct rcio_state *state, link_state_t new_state)
+{
+    WRITE_ONCE(link.state, new_state);
+    sysfs_notify(state->object, attr_group.name, state_attribute.attr.name);
+}
+
+static void rcio_link_lost(struct rcio_state *state, unsigned long last_ok, bool reset)
+{
+    link.lost_ns = ktime_get_ns();
+    link.last_detect_ms = jiffies_to_msecs(jiffies - last_ok);
+    link.losses++;
+    link.safety_off_seen = false;
+    link.retry = jiffies;
+
+    if (reset) {
+        link.resets++;
+        rcio_link_err(state->adapter->dev, "IO has been reset, reinitialising\n");
+    } else {
+        rcio_link_err(state->adapter->dev, "IO lost, no reply for %u ms\n", link.last_detect_ms);
+    }
+
+    rcio_link_set_state(state, LINK_LOST);
+}
+
+static bool rcio_link_recover(struct rcio_state *state)
+{
+    u16 version;
+
+    link.retry = jiffies + msecs_to_jiffies(link.deadline_ms);
+
+    if (state->register_get(state, PX4IO_PAGE_CONFIG, PX4IO_P_CONFIG_PROTOCOL_VERSION, &version, 1) < 0) {
+        return false;
+    }
+
+    /* replay everything a freshly booted IO does not know about */
+    if (rcio_pwm_restore(state) < 0) {
+        rcio_link_err(state->adapter->dev, "could not restore PWM configuration\n");
+        return false;
+    }
+
+    if (rcio_gpio_restore(state) < 0) {
+        rcio_link_err(state->adapter->dev, "could not restore GPIO configuration\n");
+        return false;
+    }
+
+    link.last_recover_ms = div_u64(ktime_get_ns() - link.lost_ns, NSEC_PER_MSEC);
+    link.max_recover_ms = max(link.max_recover_ms, link.last_recover_ms);
+    link.recoveries++;
+
+    rcio_link_warn(state->adapter->dev, "IO recovered in %u ms\n", link.last_recover_ms);
+
+    /* the heartbeats missed while the IO was gone are in losses already */
+    rcio_safety_heartbeat_resync();
+    rcio_link_set_state(state, LINK_UP);
+    return true;
+}
+
+/* returns whether the link is up and the other subsystems may run */
+bool rcio_link_update(struct rcio_state *state)
+{
+    struct rcio_io_status io_status;
+    unsigned long last_ok = READ_ONCE(state->last_transfer_ok);
+
+    if (link.state == LINK_LOST) {
+        if (time_before(jiffies, link.retry)) {
+            return false;
+        }
+        return rcio_link_recover(state);
+    }
+
+    if (time_after(jiffies, last_ok + msecs_to_jiffies(READ_ONCE(link.deadline_ms)))) {
+        rcio_link_lost(state, last_ok, false);
+        return false;
+    }
+
+    if (state->status_get(state, &io_status)) {
+        if (io_status.flags & PX4IO_P_STATUS_FLAGS_SAFETY_OFF) {
+            link.safety_off_seen = true;
+        } else if (link.safety_off_seen) {
+            rcio_link_lost(state, last_ok, true);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+unsigned int rcio_link_deadline_ms(void)
+{
+    return READ_ONCE(link.deadline_ms);
+}
+
+int rcio_link_probe(struct rcio_state *state)
+{
+    int ret;
+
+    link.rcio = state;
+
+    link.state = LINK_UP;
+    link.deadline_ms = 50;
+    link.safety_off_seen = false;
+
+    ret = sysfs_create_group(link.rcio->object, &attr_group);
+
+    if (ret < 0) {
+        rcio_link_err(state->adapter->dev, "module not registered int sysfs\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+EXPORT_SYMBOL_GPL(rcio_link_probe);
+EXPORT_SYMBOL_GPL(rcio_link_update);
+EXPORT_SYMBOL_GPL(rcio_link_deadline_ms);
+MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
+MODULE_DESCRIPTION("RCIO link supervisor");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,10 @@
+#ifndef _RCIO_LINK_H
+#define _RCIO_LINK_H
+
+#include "rcio.h"
+
+int rcio_link_probe(struct rcio_state *state);
+bool rcio_link_update(struct rcio_state *state);
+unsigned int rcio_link_deadline_ms(void);
+
+#endif
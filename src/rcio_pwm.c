@@ -7,6 +7,8 @@
 #include "rcio.h"
 #include "protocol.h"
 #include "rcio_pwm.h"
+#include "rcio_safety.h"
+#include "rcio_idle.h"
 
 #define PERIOD_MIN_NS 2040816
 
@@ -31,6 +33,9 @@ extern bool gpio_supported;
 
 extern uint16_t pwm_ignore_writings_mask;
 
+/* host copy of PX4IO_PAGE_PWM_EXPORTED, replayed after an IO reset */
+uint16_t pwm_exported_mask = 0;
+
 struct pwm_output_rc_config {
     uint8_t channel;
     uint16_t rc_min;
@@ -150,6 +155,40 @@ int rcio_pwm_force_zero_duty(struct rcio_state *state) {
 	return 0;
 }
 
+/* the heartbeat goes out in the same adapter session as the frame when due */
+static int rcio_pwm_send_frame(struct rcio_state *state)
+{
+    struct rcio_transfer transfers[2] = {
+        {
+            .page = PX4IO_PAGE_DIRECT_PWM,
+            .offset = 0,
+            .values = values,
+            .num_values = RCIO_PWM_MAX_CHANNELS,
+            .write = true,
+        },
+    };
+    bool heartbeat = rcio_safety_heartbeat_due();
+
+    if (heartbeat) {
+        rcio_safety_prepare_heartbeat(&transfers[1]);
+    }
+
+    state->register_transfer(state, transfers, heartbeat ? 2 : 1);
+
+    if (heartbeat) {
+        rcio_safety_heartbeat_done(state, transfers[1].result, true);
+    }
+
+    return transfers[0].result;
+}
+
+bool rcio_pwm_armed(void)
+{
+    unsigned long timeout = READ_ONCE(armtimeout);
+
+    return timeout > 0 && time_before(jiffies, timeout);
+}
+
 bool rcio_pwm_update(struct rcio_state *state)
 {
     bool some_freq_updated = alt_frequency_updated || default_frequency_updated;
@@ -211,7 +250,7 @@ bool rcio_pwm_update(struct rcio_state *state)
 	}
     
     if (armed && (!some_freq_updated )) {
-        return state->register_set(state, PX4IO_PAGE_DIRECT_PWM, 0, values, RCIO_PWM_MAX_CHANNELS);
+        return rcio_pwm_send_frame(state);
     }
 
     return true;
@@ -240,9 +279,10 @@ int rcio_hardware_init(struct rcio_state *state)
     }
 
     if (adv_timer_config_supported) {
-        //new-way
-        for (int i = 0; i < RCIO_PWM_TIMER_COUNT; i++) {
-            rcio_pwm_update_frequency(state, i);
+        //new-way, all four group rates are contiguous
+        if (state->register_set(state, PX4IO_PAGE_SETUP, PX4IO_P_SETUP_PWM_GROUP1_RATE, frequencies, RCIO_PWM_TIMER_COUNT) < 0) {
+            pr_err("group frequencies not set");
+            return -ENOTCONN;
         }
 
     } else {
@@ -271,6 +311,24 @@ int rcio_hardware_init(struct rcio_state *state)
     return 0;
 }
 
+int rcio_pwm_restore(struct rcio_state *state)
+{
+    int ret;
+
+    ret = rcio_hardware_init(state);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    //if fw does not support gpio, it does not support pwm_exported page, so skip it
+    if (gpio_supported) {
+        ret = state->register_set(state, PX4IO_PAGE_PWM_EXPORTED, 0, &pwm_exported_mask, 1);
+    }
+
+    return ret;
+}
+
 int rcio_pwm_probe(struct rcio_state *state)
 {
     int ret;
@@ -460,6 +518,7 @@ static int rcio_pwm_config(struct pwm_chip *chip, struct pwm_device *channel, in
     }
 
     armtimeout = jiffies + HZ / 10; /* timeout in 0.1s */
+    rcio_idle_kick();
     new_frequency = 1000000000 / period_ns;
     
     if (adv_timer_config_supported) {
@@ -553,6 +612,8 @@ static int rcio_pwm_request(struct pwm_chip *chip, struct pwm_device *pwm_dev)
 
         if (ret < 0) return ret;
 
+        pwm_exported_mask = pwm_exported;
+
         rcio_pwm_warn(pwm->state->adapter->dev, "Exporting pin [%d] OK\n", (int)pin_number);
 
         return 0;
@@ -582,21 +643,20 @@ static void rcio_pwm_free(struct pwm_chip *chip, struct pwm_device *pwm_dev)
     pwm_exported &= ~(1 << pin_number);
     write_result = (pwm->state->register_set(pwm->state, PX4IO_PAGE_PWM_EXPORTED, 0, &pwm_exported, 1));
 
+    if (write_result >= 0) {
+        pwm_exported_mask = pwm_exported;
+    }
+
     return;
 }
 
-static int pwm_set_initial_rc_channel_config(struct rcio_state *state, struct pwm_output_rc_config *config)
+static int pwm_fill_rc_channel_config(uint16_t *regs, struct pwm_output_rc_config *config)
 {
-    uint16_t regs[PX4IO_P_RC_CONFIG_STRIDE];
-    uint16_t offset;
-
     if (config->channel >= RCIO_PWM_MAX_CHANNELS) {
         /* fail with error */
         return -E2BIG;
     }
 
-    /* copy values to registers in IO */
-    offset = config->channel * PX4IO_P_RC_CONFIG_STRIDE;
     regs[PX4IO_P_RC_CONFIG_MIN]        = config->rc_min;
     regs[PX4IO_P_RC_CONFIG_CENTER]     = config->rc_trim;
     regs[PX4IO_P_RC_CONFIG_MAX]        = config->rc_max;
@@ -608,7 +668,7 @@ static int pwm_set_initial_rc_channel_config(struct rcio_state *state, struct pw
         regs[PX4IO_P_RC_CONFIG_OPTIONS] |= PX4IO_P_RC_CONFIG_OPTIONS_REVERSE;
     }
 
-    return state->register_set(state, PX4IO_PAGE_RC_CONFIG, offset, regs, PX4IO_P_RC_CONFIG_STRIDE);
+    return 0;
 }
 
 int pwm_check_device_motors_running_count(struct rcio_state *state) {
@@ -633,6 +693,7 @@ int pwm_check_device_motors_running_count(struct rcio_state *state) {
 
 static int pwm_set_initial_rc_config(struct rcio_state *state)
 {
+    uint16_t regs[RCIO_PWM_MAX_CHANNELS * PX4IO_P_RC_CONFIG_STRIDE];
     struct pwm_output_rc_config config = {
         .rc_min = 900,
         .rc_trim = 1500,
@@ -642,14 +703,20 @@ static int pwm_set_initial_rc_config(struct rcio_state *state)
 
     for (int channel = 0; channel < RCIO_PWM_MAX_CHANNELS; channel++) {
         config.channel = channel;
-        if (pwm_set_initial_rc_channel_config(state, &config) < 0) {
-            pr_err("RC config %d not set", channel);
-        } else {
-            pr_warn("RC config %d set successfully", channel);
-        }
+        pwm_fill_rc_channel_config(&regs[channel * PX4IO_P_RC_CONFIG_STRIDE], &config);
+    }
+
+    /* channel configs are contiguous, so send them in as few packets as possible */
+    for (int offset = 0; offset < ARRAY_SIZE(regs); offset += PKT_MAX_REGS) {
+        int count = min_t(int, PKT_MAX_REGS, ARRAY_SIZE(regs) - offset);
 
+        if (state->register_set(state, PX4IO_PAGE_RC_CONFIG, offset, &regs[offset], count) < 0) {
+            pr_err("RC config at %d not set", offset);
+        }
     }
 
+    pr_warn("RC config set");
+
     return 0;
 }
 
@@ -657,6 +724,8 @@ static int pwm_set_initial_rc_config(struct rcio_state *state)
 EXPORT_SYMBOL_GPL(rcio_pwm_probe);
 EXPORT_SYMBOL_GPL(rcio_pwm_remove);
 EXPORT_SYMBOL_GPL(rcio_pwm_update);
+EXPORT_SYMBOL_GPL(rcio_pwm_restore);
+EXPORT_SYMBOL_GPL(rcio_pwm_armed);
 MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
 MODULE_DESCRIPTION("RCIO PWM driver");
 MODULE_LICENSE("GPL v2");
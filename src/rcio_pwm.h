@@ -12,7 +12,9 @@
 int rcio_pwm_probe(struct rcio_state* state);
 bool rcio_pwm_update(struct rcio_state *state);
 int rcio_pwm_remove(struct rcio_state *state);
+int rcio_pwm_restore(struct rcio_state *state);
 int pwm_check_device_motors_running_count(struct rcio_state *state);
 int rcio_pwm_force_zero_duty(struct rcio_state *state);
+bool rcio_pwm_armed(void);
 
 #endif
@@ -3,6 +3,8 @@
 #include "rcio.h"
 #include "protocol.h"
 #include "rcio_rcin_priv.h"
+#include "rcio_idle.h"
+#include "rcio_lazy.h"
 
 #define RCIO_RCIN_MAX_CHANNELS 16
 
@@ -12,16 +14,26 @@ static int rcin_get_raw_values(struct rcio_state *state, struct rc_input_values
 
 static u16 measurements[RCIO_RCIN_MAX_CHANNELS] = {0};
 
+static struct rcio_lazy lazy;
+
 static ssize_t channel_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
     int value = -1;
 
     int channel;
+    int ret;
 
     if (sscanf(attr->attr.name, "ch%d", &channel) < 0) {
         return -EIO;
     }
 
+    rcio_idle_kick();
+
+    ret = rcio_lazy_get(&lazy);
+    if (ret < 0) {
+        return ret;
+    }
+
     value = measurements[channel];
 
     if (value < 0) {
@@ -34,9 +46,28 @@ static ssize_t channel_show(struct kobject *kobj, struct kobj_attribute *attr, c
 static bool connected; 
 static ssize_t connected_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
+    int ret;
+
+    rcio_idle_kick();
+
+    ret = rcio_lazy_get(&lazy);
+    if (ret < 0) {
+        return ret;
+    }
+
     return sprintf(buf, "%d\n", connected? 1: 0);
 }
 
+static ssize_t lazy_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return rcio_lazy_attr_show(&lazy, attr->attr.name, buf);
+}
+
+static ssize_t lazy_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    return rcio_lazy_attr_store(&lazy, attr->attr.name, buf, count);
+}
+
 #define RCIN_CHANNEL_ATTR(channel) __ATTR(channel, S_IRUGO, channel_show, NULL)
 
 static struct kobj_attribute ch0_attribute = RCIN_CHANNEL_ATTR(ch0);
@@ -57,6 +88,10 @@ static struct kobj_attribute ch14_attribute = RCIN_CHANNEL_ATTR(ch14);
 static struct kobj_attribute ch15_attribute = RCIN_CHANNEL_ATTR(ch15);
 
 static struct kobj_attribute connected_attribute = __ATTR_RO(connected);
+static struct kobj_attribute policy_attribute = __ATTR(policy, S_IRUGO | S_IWUSR, lazy_show, lazy_store);
+static struct kobj_attribute max_age_ms_attribute = __ATTR(max_age_ms, S_IRUGO | S_IWUSR, lazy_show, lazy_store);
+static struct kobj_attribute lazy_poll_ms_attribute = __ATTR(lazy_poll_ms, S_IRUGO | S_IWUSR, lazy_show, lazy_store);
+static struct kobj_attribute refreshes_attribute = __ATTR(refreshes, S_IRUGO, lazy_show, NULL);
 
 static struct attribute *attrs[] = {
     &ch0_attribute.attr,
@@ -76,6 +111,10 @@ static struct attribute *attrs[] = {
     &ch14_attribute.attr,
     &ch15_attribute.attr,
     &connected_attribute.attr,
+    &policy_attribute.attr,
+    &max_age_ms_attribute.attr,
+    &lazy_poll_ms_attribute.attr,
+    &refreshes_attribute.attr,
     NULL,
 };
 
@@ -86,15 +125,11 @@ static struct attribute_group attr_group = {
 
 static unsigned long timeout;
 
-bool rcio_rcin_update(struct rcio_state *state)
+static bool rcin_refresh(struct rcio_state *state)
 {
     int ret;
     struct rc_input_values report;
 
-    if (time_before(jiffies, timeout)) {
-        return false;
-    }
-
     ret = rcin_get_raw_values(state, &report);
 
     if (ret == -ENOTCONN) {
@@ -117,12 +152,21 @@ bool rcio_rcin_update(struct rcio_state *state)
 
         measurements[i] = report.values[i];
     }
-    
-    timeout = jiffies + HZ / 100; /* timeout in 0.01s */
 
     return true;
 }
 
+bool rcio_rcin_update(struct rcio_state *state)
+{
+    return rcio_lazy_poll(&lazy, &timeout, HZ / 100); /* timeout in 0.01s */
+}
+
+bool rcio_rcin_read(u16 *values)
+{
+    memcpy(values, measurements, sizeof(measurements));
+    return connected;
+}
+
 int rcio_rcin_probe(struct rcio_state *state)
 {
     int ret;
@@ -131,6 +175,9 @@ int rcio_rcin_probe(struct rcio_state *state)
 
     timeout = jiffies + HZ / 100; /* timeout in 0.01s */
 
+    /* RC values older than two frames are not worth showing */
+    rcio_lazy_init(&lazy, state, rcin_refresh, 40);
+
     ret = sysfs_create_group(rcio->object, &attr_group);
 
     if (ret < 0) {
@@ -144,13 +191,16 @@ int rcio_rcin_probe(struct rcio_state *state)
 
 static int rcin_get_raw_values(struct rcio_state *state, struct rc_input_values *rc_val)
 {
+    struct rcio_io_status io_status;
     uint16_t status;
-    int ret;
 
-    if ((ret = state->register_get(state, PX4IO_PAGE_STATUS, PX4IO_P_STATUS_FLAGS, &status, 1)) < 0) {
-        return ret;
+    /* flags come from the status page the core fetches every cycle */
+    if (!state->status_get(state, &io_status)) {
+        return -EIO;
     }
 
+    status = io_status.flags;
+
     /* if no R/C input, don't try to fetch anything */
     if (!(status & PX4IO_P_STATUS_FLAGS_RC_OK)) {
         return -ENOTCONN;
@@ -184,6 +234,7 @@ static int rcin_get_raw_values(struct rcio_state *state, struct rc_input_values
 
 EXPORT_SYMBOL_GPL(rcio_rcin_probe);
 EXPORT_SYMBOL_GPL(rcio_rcin_update);
+EXPORT_SYMBOL_GPL(rcio_rcin_read);
 
 MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
 MODULE_DESCRIPTION("RCIO RC Input driver");
@@ -5,5 +5,6 @@
 
 int rcio_rcin_probe(struct rcio_state* state);
 bool rcio_rcin_update(struct rcio_state* state);
+bool rcio_rcin_read(u16 *values);
 
 #endif
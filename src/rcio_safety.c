@@ -1,5 +1,6 @@
 #include <linux/delay.h>
 #include <linux/module.h>
+#include <linux/ktime.h>
 #define DEBUG
 #include <linux/device.h>
 
@@ -10,20 +11,123 @@
         dev_err(__dev, "rcio_safety: " format, ##args)
 #define rcio_safety_warn(__dev, format, args...)\
         dev_warn(__dev, "rcio_safety: " format, ##args)
+#define rcio_safety_warn_ratelimited(__dev, format, args...)\
+        dev_warn_ratelimited(__dev, "rcio_safety: " format, ##args)
 
+#define RCIO_SAFETY_MIN_HEARTBEAT_PERIOD_MS 20
+#define RCIO_SAFETY_MAX_HEARTBEAT_PERIOD_MS 1000
+#define RCIO_SAFETY_MIN_WATCHDOG_TIMEOUT_MS 100
+#define RCIO_SAFETY_MAX_WATCHDOG_TIMEOUT_MS 10000
+
+/* interval histogram buckets are powers of two in ms, the last one catches the rest */
+#define RCIO_SAFETY_HISTOGRAM_BUCKETS 12
+
+/*
+ * While the outputs are armed the heartbeat rides along with the PWM frame
+ * (see rcio_pwm_update()), rcio_safety_update() only sends it on its own
+ * when nobody picked it up. The age is the time since the IO last accepted
+ * a heartbeat, so a stalled worker shows up here well before the IO side
+ * watchdog gives up on us.
+ *
+ * The IO has no register for its watchdog timeout, watchdog_timeout_ms is
+ * the host side copy of it: the heartbeat period has to stay well below it
+ * and intervals getting within a quarter of it are reported.
+ */
 static struct rcio_safety {
     struct rcio_state *rcio;
     unsigned long timeout;
     bool heartbeat_enabled;
     uint16_t heartbeat;
+    unsigned int period_ms;
+    unsigned int watchdog_timeout_ms;
+
+    u64 last_heartbeat_ns;
+    /* the next heartbeat follows a pause, its interval says nothing about the loop */
+    bool resync;
+    unsigned int histogram[RCIO_SAFETY_HISTOGRAM_BUCKETS];
+    unsigned int near_misses;
+    unsigned int max_age_ms;
+    unsigned int sent;
+    unsigned int piggybacked;
+    unsigned int failed;
 } safety;
 
 bool rcio_safety_update(struct rcio_state *state);
 
-static int rcio_safety_do_heartbeat(struct rcio_state *state) {
-    int result = state->register_set(state, PX4IO_PAGE_RCIO_HEARTBEAT, 0, &safety.heartbeat, 1);
+static unsigned int rcio_safety_heartbeat_age_ms(void)
+{
+    return div_u64(ktime_get_ns() - READ_ONCE(safety.last_heartbeat_ns), NSEC_PER_MSEC);
+}
+
+bool rcio_safety_heartbeat_due(void)
+{
+    return safety.heartbeat_enabled && !time_before(jiffies, safety.timeout);
+}
+
+void rcio_safety_prepare_heartbeat(struct rcio_transfer *transfer)
+{
+    transfer->page = PX4IO_PAGE_RCIO_HEARTBEAT;
+    transfer->offset = 0;
+    transfer->values = &safety.heartbeat;
+    transfer->num_values = 1;
+    transfer->write = true;
+}
+
+static void rcio_safety_account_interval(struct rcio_state *state, unsigned int interval_ms)
+{
+    unsigned int watchdog_ms = READ_ONCE(safety.watchdog_timeout_ms);
+    int bucket = interval_ms ? min(ilog2(interval_ms) + 1, RCIO_SAFETY_HISTOGRAM_BUCKETS - 1) : 0;
+
+    safety.histogram[bucket]++;
+    safety.max_age_ms = max(safety.max_age_ms, interval_ms);
+
+    if (interval_ms >= watchdog_ms - watchdog_ms / 4) {
+        safety.near_misses++;
+        rcio_safety_warn_ratelimited(state->adapter->dev,
+                "Heartbeat interval %u ms is close to the IO watchdog timeout of %u ms\n",
+                interval_ms, watchdog_ms);
+    }
+}
+
+/* heartbeats resume after being disabled or after the link came back */
+void rcio_safety_heartbeat_resync(void)
+{
+    WRITE_ONCE(safety.resync, true);
+}
+
+void rcio_safety_heartbeat_done(struct rcio_state *state, int result, bool piggybacked)
+{
+    u64 now = ktime_get_ns();
+
+    if (result < 0) {
+        safety.failed++;
+        rcio_safety_err(state->adapter->dev, "Could not do heartbeat\n");
+        rcio_safety_heartbeat_resync();
+    } else {
+        if (READ_ONCE(safety.resync)) {
+            WRITE_ONCE(safety.resync, false);
+        } else {
+            rcio_safety_account_interval(state, div_u64(now - safety.last_heartbeat_ns, NSEC_PER_MSEC));
+        }
+
+        WRITE_ONCE(safety.last_heartbeat_ns, now);
+
+        if (piggybacked) {
+            safety.piggybacked++;
+        } else {
+            safety.sent++;
+        }
+    }
+
     safety.heartbeat++;
     if (safety.heartbeat > 0xFF) safety.heartbeat = 0;
+
+    safety.timeout = jiffies + msecs_to_jiffies(READ_ONCE(safety.period_ms));
+}
+
+static int rcio_safety_do_heartbeat(struct rcio_state *state) {
+    int result = state->register_set(state, PX4IO_PAGE_RCIO_HEARTBEAT, 0, &safety.heartbeat, 1);
+    rcio_safety_heartbeat_done(state, result, false);
     return result;
 }
 
@@ -41,6 +145,11 @@ static ssize_t heartbeat_enabled_store(struct kobject *kobj, struct kobj_attribu
     if (result == 0) {
         bool heartbeat_enabled = (value != 0);
         rcio_safety_warn(safety.rcio->adapter->dev, "Heartbeat_enabled is set to %d\n", heartbeat_enabled);
+
+        if (heartbeat_enabled && !safety.heartbeat_enabled) {
+            rcio_safety_heartbeat_resync();
+        }
+
         safety.heartbeat_enabled = heartbeat_enabled;
     } else {
         rcio_safety_err(safety.rcio->adapter->dev, "Invalid value for heartbeat_enable");
@@ -49,10 +158,108 @@ static ssize_t heartbeat_enabled_store(struct kobject *kobj, struct kobj_attribu
     return count;
 }
 
+static ssize_t heartbeat_age_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", rcio_safety_heartbeat_age_ms());
+}
+
+static ssize_t heartbeat_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "max_age_ms: %u\nstandalone: %u\npiggybacked: %u\nfailed: %u\nnear_misses: %u\n",
+            safety.max_age_ms, safety.sent, safety.piggybacked, safety.failed, safety.near_misses);
+}
+
+static ssize_t heartbeat_stats_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    safety.max_age_ms = 0;
+    safety.sent = 0;
+    safety.piggybacked = 0;
+    safety.failed = 0;
+    safety.near_misses = 0;
+    memset(safety.histogram, 0, sizeof(safety.histogram));
+
+    return count;
+}
+
+static ssize_t heartbeat_histogram_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    ssize_t len = 0;
+
+    /* upper bound of the bucket in ms and the number of intervals that fell in it */
+    for (int i = 0; i < RCIO_SAFETY_HISTOGRAM_BUCKETS - 1; i++) {
+        len += scnprintf(buf + len, PAGE_SIZE - len, "<%u %u\n", 1 << i, safety.histogram[i]);
+    }
+
+    len += scnprintf(buf + len, PAGE_SIZE - len, ">=%u %u\n", 1 << (RCIO_SAFETY_HISTOGRAM_BUCKETS - 2),
+            safety.histogram[RCIO_SAFETY_HISTOGRAM_BUCKETS - 1]);
+
+    return len;
+}
+
+static ssize_t heartbeat_period_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", safety.period_ms);
+}
+
+static ssize_t heartbeat_period_ms_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int value;
+
+    if (kstrtouint(buf, 10, &value) < 0 || value < RCIO_SAFETY_MIN_HEARTBEAT_PERIOD_MS || value > RCIO_SAFETY_MAX_HEARTBEAT_PERIOD_MS) {
+        rcio_safety_err(safety.rcio->adapter->dev, "Invalid value for heartbeat_period_ms, this should be from %d to %d\n",
+                RCIO_SAFETY_MIN_HEARTBEAT_PERIOD_MS, RCIO_SAFETY_MAX_HEARTBEAT_PERIOD_MS);
+        return -EINVAL;
+    }
+
+    if (value > safety.watchdog_timeout_ms / 2) {
+        rcio_safety_err(safety.rcio->adapter->dev, "Invalid value for heartbeat_period_ms, this should be at most half of watchdog_timeout_ms\n");
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(safety.period_ms, value);
+
+    return count;
+}
+
+static ssize_t watchdog_timeout_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", safety.watchdog_timeout_ms);
+}
+
+static ssize_t watchdog_timeout_ms_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int value;
+
+    if (kstrtouint(buf, 10, &value) < 0 || value < RCIO_SAFETY_MIN_WATCHDOG_TIMEOUT_MS || value > RCIO_SAFETY_MAX_WATCHDOG_TIMEOUT_MS) {
+        rcio_safety_err(safety.rcio->adapter->dev, "Invalid value for watchdog_timeout_ms, this should be from %d to %d\n",
+                RCIO_SAFETY_MIN_WATCHDOG_TIMEOUT_MS, RCIO_SAFETY_MAX_WATCHDOG_TIMEOUT_MS);
+        return -EINVAL;
+    }
+
+    if (value < safety.period_ms * 2) {
+        rcio_safety_err(safety.rcio->adapter->dev, "Invalid value for watchdog_timeout_ms, this should be at least twice heartbeat_period_ms\n");
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(safety.watchdog_timeout_ms, value);
+
+    return count;
+}
+
 static struct kobj_attribute heartbeat_enabled_attribute = __ATTR_RW(heartbeat_enabled);
+static struct kobj_attribute heartbeat_age_ms_attribute = __ATTR_RO(heartbeat_age_ms);
+static struct kobj_attribute heartbeat_stats_attribute = __ATTR_RW(heartbeat_stats);
+static struct kobj_attribute heartbeat_histogram_attribute = __ATTR_RO(heartbeat_histogram);
+static struct kobj_attribute heartbeat_period_ms_attribute = __ATTR_RW(heartbeat_period_ms);
+static struct kobj_attribute watchdog_timeout_ms_attribute = __ATTR_RW(watchdog_timeout_ms);
 
 static struct attribute *attrs[] = {
     &heartbeat_enabled_attribute.attr,
+    &heartbeat_age_ms_attribute.attr,
+    &heartbeat_stats_attribute.attr,
+    &heartbeat_histogram_attribute.attr,
+    &heartbeat_period_ms_attribute.attr,
+    &watchdog_timeout_ms_attribute.attr,
     NULL,
 };
 
@@ -67,16 +274,26 @@ bool rcio_safety_update(struct rcio_state *state)
         return false;
     }
 
+    /* the PWM frame did not take it this cycle, i.e. outputs are idle */
     if (safety.heartbeat_enabled) {
-        if (!rcio_safety_do_heartbeat(state)) {
-            rcio_safety_err(state->adapter->dev, "Could not do heartbeat\n");
-        }
+        rcio_safety_do_heartbeat(state);
+    } else {
+        safety.timeout = jiffies + msecs_to_jiffies(READ_ONCE(safety.period_ms));
     }
 
-    safety.timeout = jiffies + msecs_to_jiffies(200); /* timeout in 0.2s */
     return true;
 }
 
+unsigned int rcio_safety_heartbeat_period_ms(void)
+{
+    return READ_ONCE(safety.period_ms);
+}
+
+uint16_t rcio_safety_read_heartbeat(void)
+{
+    return safety.heartbeat;
+}
+
 bool rcio_safety_probe(struct rcio_state *state)
 {
     int ret;
@@ -94,12 +311,22 @@ bool rcio_safety_probe(struct rcio_state *state)
 
     safety.heartbeat = 0;
     safety.heartbeat_enabled = true;
+    safety.period_ms = 200;
+    safety.watchdog_timeout_ms = 1000;
+    safety.last_heartbeat_ns = ktime_get_ns();
+    safety.resync = false;
 
     return true;
 }
 
 EXPORT_SYMBOL_GPL(rcio_safety_probe);
 EXPORT_SYMBOL_GPL(rcio_safety_update);
+EXPORT_SYMBOL_GPL(rcio_safety_read_heartbeat);
+EXPORT_SYMBOL_GPL(rcio_safety_heartbeat_period_ms);
+EXPORT_SYMBOL_GPL(rcio_safety_heartbeat_due);
+EXPORT_SYMBOL_GPL(rcio_safety_prepare_heartbeat);
+EXPORT_SYMBOL_GPL(rcio_safety_heartbeat_done);
+EXPORT_SYMBOL_GPL(rcio_safety_heartbeat_resync);
 MODULE_AUTHOR("Nikita Tomilov <nikita.tomilov@emlid.com>");
 MODULE_DESCRIPTION("RCIO safety driver");
 MODULE_LICENSE("GPL v2");
@@ -5,5 +5,11 @@
 
 bool rcio_safety_probe(struct rcio_state* state);
 bool rcio_safety_update(struct rcio_state *state);
+uint16_t rcio_safety_read_heartbeat(void);
+unsigned int rcio_safety_heartbeat_period_ms(void);
+bool rcio_safety_heartbeat_due(void);
+void rcio_safety_prepare_heartbeat(struct rcio_transfer *transfer);
+void rcio_safety_heartbeat_done(struct rcio_state *state, int result, bool piggybacked);
+void rcio_safety_heartbeat_resync(void);
 
 #endif
@@ -1,12 +1,239 @@
 #include <linux/delay.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/spi/spi.h>
+#include <linux/sysfs.h>
 
 #include "rcio.h"
 #include "protocol.h"
+#include "rcio_bus.h"
+#include "rcio_debug.h"
+#include "rcio_pwm.h"
+#include "rcio_trace.h"
 
 static struct IOPacket *buffer;
 
+/* only touched under the adapter lock, like the buffer */
+static u64 lock_wait_ns;
+
+static inline u64 rcio_spi_trace_clock(void)
+{
+    return trace_rcio_spi_xfer_enabled() ? ktime_get_ns() : 0;
+}
+
+/* 0 when the tracepoint was off at start, it may have been switched on since */
+static inline u64 rcio_spi_trace_since(u64 start)
+{
+    return start ? ktime_get_ns() - start : 0;
+}
+
+static void rcio_spi_lock(struct rcio_adapter *state)
+{
+    u64 start = rcio_spi_trace_clock();
+
+    mutex_lock(&state->lock);
+    lock_wait_ns = rcio_spi_trace_since(start);
+}
+
+/* the gap used to be a fixed 120-150 us, which stays the safe starting point */
+#define RCIO_SPI_DEFAULT_GAP_US 120
+#define RCIO_SPI_MIN_GAP_US 5
+#define RCIO_SPI_MAX_GAP_US 300
+#define RCIO_SPI_GAP_SLACK_US 10
+
+/* below this a sleep overshoots by more than it saves, so spin instead */
+#define RCIO_SPI_BUSY_WAIT_US 20
+
+#define RCIO_SPI_CALIBRATION_ROUNDS 32
+#define RCIO_SPI_CALIBRATION_REGS 8
+
+/* CRC errors per window of transactions that make the gap widen */
+#define RCIO_SPI_GAP_WINDOW 256
+#define RCIO_SPI_GAP_WINDOW_ERRORS 2
+
+/* clock rates tried at probe, fastest first */
+static const u32 rcio_spi_rates[] = {
+    16000000, 12000000, 10000000, 8000000, 6000000, 4000000, 2000000, 1000000,
+};
+
+#define RCIO_SPI_RATE_ROUNDS 64
+
+static unsigned int max_speed_hz = 0;
+module_param(max_speed_hz, uint, S_IRUGO);
+MODULE_PARM_DESC(max_speed_hz, "Fastest SPI clock tried at probe, 0 (default) to keep the device tree rate");
+
+static unsigned int gap_us[UNKNOWN_BOARD];
+module_param_array(gap_us, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(gap_us, "Request/response gap in us per board type (NAVIO2,EDGE,...), 0 to calibrate at probe");
+
+/*
+ * The IO needs time between the request and the response phase, and that
+ * time depends on the board and the firmware build. It is measured at
+ * probe unless pinned with the gap_us parameter, and widened whenever
+ * CRC errors or stale replies pile up. Everything here is touched under
+ * the adapter lock.
+ */
+static struct rcio_spi_timing {
+    unsigned int gap_us;
+    unsigned int calibrated_us;
+    bool calibrating;
+
+    unsigned int window;
+    unsigned int window_errors;
+
+    unsigned int transactions;
+    unsigned int crc_errors;
+    unsigned int stale_replies;
+    unsigned int widened;
+} timing = {
+    .gap_us = RCIO_SPI_DEFAULT_GAP_US,
+};
+
+/*
+ * The clock starts at the device tree rate, or with max_speed_hz at the
+ * fastest rate of the ladder that passes a burst of CRC checked reads at
+ * probe. When errors pile up later on, the clock is the first suspect
+ * while it runs above the device tree rate, then the gap, then the clock
+ * again. rung is the fastest ladder rate not above the current one, so
+ * any rate has somewhere to step down to, and -1 below the slowest.
+ * Touched under the adapter lock, like the timing.
+ */
+static struct rcio_spi_clock {
+    u32 dt_hz;
+    u32 speed_hz;
+    int rung;
+    unsigned int step_downs;
+} spi_clock;
+
+static int rcio_spi_rung(u32 hz)
+{
+    for (int i = 0; i < ARRAY_SIZE(rcio_spi_rates); i++) {
+        if (rcio_spi_rates[i] <= hz) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int rcio_spi_set_speed(struct rcio_adapter *state, u32 hz)
+{
+    struct spi_device *spi = state->client;
+    u32 previous = spi->max_speed_hz;
+    int ret;
+
+    spi->max_speed_hz = hz;
+    ret = spi_setup(spi);
+
+    if (ret < 0) {
+        spi->max_speed_hz = previous;
+        spi_setup(spi);
+        return ret;
+    }
+
+    /* the controller may have rounded it down */
+    spi_clock.speed_hz = spi->max_speed_hz;
+    spi_clock.rung = rcio_spi_rung(spi_clock.speed_hz);
+
+    return 0;
+}
+
+static bool rcio_spi_step_down(struct rcio_adapter *state, bool below_dt)
+{
+    int rung = spi_clock.rung;
+
+    if (rung < 0) {
+        return false;
+    }
+
+    /* a rate between two rungs goes to the one below it first */
+    if (rcio_spi_rates[rung] >= spi_clock.speed_hz) {
+        rung++;
+    }
+
+    if (rung >= ARRAY_SIZE(rcio_spi_rates)) {
+        return false;
+    }
+
+    if (!below_dt && rcio_spi_rates[rung] < spi_clock.dt_hz) {
+        return false;
+    }
+
+    if (rcio_spi_set_speed(state, rcio_spi_rates[rung]) < 0) {
+        return false;
+    }
+
+    spi_clock.step_downs++;
+
+    return true;
+}
+
+static void rcio_spi_gap(void)
+{
+    unsigned int gap = timing.gap_us;
+
+    if (gap <= RCIO_SPI_BUSY_WAIT_US) {
+        udelay(gap);
+    } else {
+        usleep_range(gap, gap + RCIO_SPI_GAP_SLACK_US);
+    }
+}
+
+/* a reply that failed its CRC or answered an earlier request, both mean the gap is too short */
+static void rcio_spi_gap_account(struct rcio_adapter *state, int crc_ok, bool stale)
+{
+    if (timing.calibrating) {
+        return;
+    }
+
+    timing.transactions++;
+    timing.window++;
+
+    if (crc_ok == 0) {
+        timing.crc_errors++;
+        timing.window_errors++;
+    } else if (stale) {
+        timing.stale_replies++;
+        timing.window_errors++;
+    }
+
+    if (timing.window_errors >= RCIO_SPI_GAP_WINDOW_ERRORS) {
+        unsigned int widened = min(timing.gap_us + max(timing.gap_us / 4, RCIO_SPI_MIN_GAP_US), (unsigned int)RCIO_SPI_MAX_GAP_US);
+
+        if (spi_clock.speed_hz > spi_clock.dt_hz && rcio_spi_step_down(state, false)) {
+            dev_warn(state->dev, "rcio_spi: %u bad replies in %u transactions, clock down to %u Hz\n",
+                    timing.window_errors, timing.window, spi_clock.speed_hz);
+        } else if (timing.gap_us < RCIO_SPI_MAX_GAP_US) {
+            dev_warn(state->dev, "rcio_spi: %u bad replies in %u transactions, widening the gap from %u to %u us\n",
+                    timing.window_errors, timing.window, timing.gap_us, widened);
+
+            timing.gap_us = widened;
+            timing.widened++;
+        } else if (rcio_spi_step_down(state, true)) {
+            dev_warn(state->dev, "rcio_spi: %u bad replies in %u transactions, clock down to %u Hz\n",
+                    timing.window_errors, timing.window, spi_clock.speed_hz);
+        }
+    }
+
+    if (timing.window >= RCIO_SPI_GAP_WINDOW || timing.window_errors >= RCIO_SPI_GAP_WINDOW_ERRORS) {
+        timing.window = 0;
+        timing.window_errors = 0;
+    }
+}
+
+/*
+ * the first packet after taking the lock carries the wait for it, a packet
+ * that started before the tracepoint was enabled has no timing and is skipped
+ */
+static void rcio_spi_trace(u8 page, u8 offset, u8 count, bool write, u64 start, int crc, int result)
+{
+    if (start) {
+        trace_rcio_spi_xfer(page, offset, count, write, lock_wait_ns, rcio_spi_trace_since(start), crc, result);
+    }
+
+    lock_wait_ns = 0;
+}
+
 static int wait_complete(struct spi_device *spi)
 {
     int ret;
@@ -14,14 +241,14 @@ static int wait_complete(struct spi_device *spi)
     buffer->crc = 0;
     buffer->crc = crc_packet(buffer);
 
-    usleep_range(120, 150);
+    rcio_spi_gap();
 
     ret = spi_write_then_read(spi, (char *) buffer, sizeof(struct IOPacket), NULL, 0);
     
     if (ret < 0)
         return ret;
 
-    usleep_range(120, 150);
+    rcio_spi_gap();
     ret = spi_write_then_read(spi, NULL, 0, (char *) buffer, sizeof(struct IOPacket));
 
     if (ret < 0)
@@ -30,17 +257,20 @@ static int wait_complete(struct spi_device *spi)
     return 0;
 }
 
-static int rcio_spi_write(struct rcio_adapter *state, u16 address, const char *data, size_t count)
+static int __rcio_spi_write(struct rcio_adapter *state, u16 address, const char *data, size_t count)
 {
     int result;
+    int crc_ok = -1;
     struct spi_device *spi = state->client;
     u16 *values = (u16 *) data;
     u8 page = address >> 8;
     u8 offset = address & 0xff;
+    u64 start;
 
     if (count > PKT_MAX_REGS)
         return -EINVAL;
-    mutex_lock(&state->lock);
+
+    start = rcio_spi_trace_clock();
 
     buffer->count_code = count | PKT_CODE_WRITE;
     buffer->page = page;
@@ -58,9 +288,13 @@ static int rcio_spi_write(struct rcio_adapter *state, u16 address, const char *d
         uint8_t crc = buffer->crc;
         buffer->crc = 0;
 
-        if (crc != crc_packet(buffer)) {
+        crc_ok = crc == crc_packet(buffer);
+
+        if (!crc_ok) {
+            rcio_debug_error(page, true, RCIO_DEBUG_CRC);
             result = -EIO;
         } else if (PKT_CODE(*buffer) == PKT_CODE_ERROR) {
+            rcio_debug_error(page, true, RCIO_DEBUG_CODE_ERROR);
             result = -EINVAL;
         }
 
@@ -68,24 +302,28 @@ static int rcio_spi_write(struct rcio_adapter *state, u16 address, const char *d
 
     if (result == 0)
         result = count;
-        
-    mutex_unlock(&state->lock);
+
+    rcio_spi_gap_account(state, crc_ok, false);
+    rcio_spi_trace(page, offset, count, true, start, crc_ok, result);
 
     return result;
 }
 
-static int rcio_spi_read(struct rcio_adapter *state, u16 address, char *data, size_t count)
+static int __rcio_spi_read(struct rcio_adapter *state, u16 address, char *data, size_t count)
 {
     int result;
+    int crc_ok = -1;
+    bool stale = false;
     struct spi_device *spi = state->client;
     u16 *values = (u16 *) data;
     u8 page = address >> 8;
     u8 offset = address & 0xff;
+    u64 start;
 
     if (count > PKT_MAX_REGS)
         return -EINVAL;
 
-    mutex_lock(&state->lock);
+    start = rcio_spi_trace_clock();
 
     buffer->count_code = count | PKT_CODE_READ;
     buffer->page = page;
@@ -99,19 +337,34 @@ static int rcio_spi_read(struct rcio_adapter *state, u16 address, char *data, si
         uint8_t crc = buffer->crc;
         buffer->crc = 0;
 
-        if (crc != crc_packet(buffer)) {
+        crc_ok = crc == crc_packet(buffer);
+
+        if (!crc_ok) {
+            rcio_debug_error(page, false, RCIO_DEBUG_CRC);
             result = -EIO;
 
         /* check result in packet */
         } else if (PKT_CODE(*buffer) == PKT_CODE_ERROR) {
 
             /* IO didn't like it - no point retrying */
+            rcio_debug_error(page, false, RCIO_DEBUG_CODE_ERROR);
             result = -EINVAL;
 
+        /*
+         * The IO echoes page and offset. A good CRC on somebody else's
+         * registers is the previous reply, picked up because the gap was
+         * too short, and must not be handed out as ours.
+         */
+        } else if (buffer->page != page || buffer->offset != offset) {
+            rcio_debug_error(page, false, RCIO_DEBUG_STALE);
+            stale = true;
+            result = -EIO;
+
         /* compare the received count with the expected count */
         } else if (PKT_COUNT(*buffer) != count) {
 
             /* IO returned the wrong number of registers - no point retrying */
+            rcio_debug_error(page, false, RCIO_DEBUG_SHORT_READ);
             result = -EIO;
 
         /* successful read */
@@ -125,12 +378,415 @@ static int rcio_spi_read(struct rcio_adapter *state, u16 address, char *data, si
 
     if (result == 0)
         result = count;
+
+    rcio_spi_gap_account(state, crc_ok, stale);
+    rcio_spi_trace(page, offset, count, false, start, crc_ok, result);
+
+    return result;
+}
+
+static int rcio_spi_write(struct rcio_adapter *state, u16 address, const char *data, size_t count)
+{
+    int result;
+
+    rcio_spi_lock(state);
+    result = __rcio_spi_write(state, address, data, count);
+    mutex_unlock(&state->lock);
+
+    return result;
+}
+
+static int rcio_spi_read(struct rcio_adapter *state, u16 address, char *data, size_t count)
+{
+    int result;
+
+    rcio_spi_lock(state);
+    result = __rcio_spi_read(state, address, data, count);
+    mutex_unlock(&state->lock);
+
+    return result;
+}
+
+/*
+ * The protocol addresses a single page per packet, so a batch is still
+ * one packet per transfer, but they go out back to back under one lock
+ * and nobody else can slip in between.
+ */
+static int rcio_spi_transfer(struct rcio_adapter *state, struct rcio_transfer *transfers, int count)
+{
+    int result = 0;
+
+    rcio_spi_lock(state);
+
+    for (int i = 0; i < count; i++) {
+        struct rcio_transfer *transfer = &transfers[i];
+        u16 address = (transfer->page << 8) | transfer->offset;
+
+        if (transfer->write) {
+            transfer->result = __rcio_spi_write(state, address, (const char *)transfer->values, transfer->num_values);
+        } else {
+            transfer->result = __rcio_spi_read(state, address, (char *)transfer->values, transfer->num_values);
+        }
+
+        if (transfer->result < 0 && result == 0) {
+            result = transfer->result;
+        }
+    }
+
     mutex_unlock(&state->lock);
+
     return result;
 }
 
+/*
+ * Calibration packets go out at trial settings that would break ordinary
+ * traffic. Once the core is up every one of them takes the bus through
+ * the arbiter as a config packet and puts the adapter's own settings back
+ * before letting go of it, so the PWM loop only ever waits for a single
+ * packet and never runs at a trial gap or clock. Before that nobody else
+ * can use the adapter and the locks are skipped. lock serialises
+ * calibrations against each other.
+ */
+static struct rcio_spi_trial {
+    struct mutex lock;
+    bool shared;
+    unsigned int gap_us;
+    u32 speed_hz;
+} trial;
+
+static void rcio_spi_trial_lock(struct rcio_adapter *state)
+{
+    if (trial.shared) {
+        rcio_bus_acquire(RCIO_BUS_CONFIG);
+        rcio_spi_lock(state);
+    }
+}
+
+static void rcio_spi_trial_unlock(struct rcio_adapter *state)
+{
+    if (trial.shared) {
+        mutex_unlock(&state->lock);
+        rcio_bus_release(RCIO_BUS_CONFIG);
+    }
+}
+
+static int rcio_spi_trial_read(struct rcio_adapter *state, u16 address, u16 *regs, size_t count)
+{
+    unsigned int gap_us;
+    u32 speed_hz;
+    int ret = -EIO;
+
+    rcio_spi_trial_lock(state);
+
+    gap_us = timing.gap_us;
+    speed_hz = spi_clock.speed_hz;
+
+    if (trial.speed_hz == speed_hz || rcio_spi_set_speed(state, trial.speed_hz) == 0) {
+        timing.gap_us = trial.gap_us;
+        timing.calibrating = true;
+        ret = __rcio_spi_read(state, address, (char *)regs, count);
+        timing.calibrating = false;
+        timing.gap_us = gap_us;
+    }
+
+    if (spi_clock.speed_hz != speed_hz) {
+        rcio_spi_set_speed(state, speed_hz);
+    }
+
+    rcio_spi_trial_unlock(state);
+
+    return ret;
+}
+
+/*
+ * The static config page read at two offsets. Rounds alternate between
+ * them, so a reply left over from the previous request, which still has
+ * a good CRC, shows up as the wrong window instead of passing.
+ */
+typedef u16 rcio_spi_reference_t[2][RCIO_SPI_CALIBRATION_REGS];
+
+static int rcio_spi_read_reference(struct rcio_adapter *state, rcio_spi_reference_t reference)
+{
+    for (int i = 0; i < 2; i++) {
+        if (rcio_spi_trial_read(state, (PX4IO_PAGE_CONFIG << 8) | i, reference[i], RCIO_SPI_CALIBRATION_REGS) !=
+                RCIO_SPI_CALIBRATION_REGS) {
+            return -EIO;
+        }
+    }
+
+    /* windows that read the same cannot tell a stale reply from a fresh one */
+    if (!memcmp(reference[0], reference[1], sizeof(reference[0]))) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static bool rcio_spi_replies_match(struct rcio_adapter *state, int rounds, rcio_spi_reference_t reference)
+{
+    u16 regs[RCIO_SPI_CALIBRATION_REGS];
+
+    for (int i = 0; i < rounds; i++) {
+        if (rcio_spi_trial_read(state, (PX4IO_PAGE_CONFIG << 8) | (i & 1), regs, RCIO_SPI_CALIBRATION_REGS) !=
+                RCIO_SPI_CALIBRATION_REGS) {
+            return false;
+        }
+
+        if (memcmp(regs, reference[i & 1], sizeof(regs))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool rcio_spi_gap_works(struct rcio_adapter *state, unsigned int gap, rcio_spi_reference_t reference)
+{
+    trial.gap_us = gap;
+
+    return rcio_spi_replies_match(state, RCIO_SPI_CALIBRATION_ROUNDS, reference);
+}
+
+/*
+ * Binary search for the shortest gap that still gets every reply through
+ * with a good CRC and the same static config page, plus a margin. Takes
+ * tens of ms of bus time, so it runs at probe or on request only. Called
+ * with trial.lock held or before anybody else can use the adapter.
+ */
+static int rcio_spi_calibrate(struct rcio_adapter *state)
+{
+    rcio_spi_reference_t reference;
+    unsigned int low = RCIO_SPI_MIN_GAP_US;
+    unsigned int high = RCIO_SPI_DEFAULT_GAP_US;
+
+    trial.gap_us = high;
+    trial.speed_hz = spi_clock.speed_hz;
+
+    if (rcio_spi_read_reference(state, reference) < 0 || !rcio_spi_gap_works(state, high, reference)) {
+        dev_warn(state->dev, "rcio_spi: no stable replies at %u us, gap not calibrated\n", high);
+        return -EIO;
+    }
+
+    while (low < high) {
+        unsigned int middle = (low + high) / 2;
+
+        if (rcio_spi_gap_works(state, middle, reference)) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    rcio_spi_trial_lock(state);
+    timing.calibrated_us = high;
+    timing.gap_us = min(high + max(high / 4, RCIO_SPI_MIN_GAP_US), (unsigned int)RCIO_SPI_MAX_GAP_US);
+    timing.window = 0;
+    timing.window_errors = 0;
+    rcio_spi_trial_unlock(state);
+
+    return 0;
+}
+
+static bool rcio_spi_rate_works(struct rcio_adapter *state, u32 hz, rcio_spi_reference_t reference)
+{
+    trial.speed_hz = hz;
+
+    return rcio_spi_replies_match(state, RCIO_SPI_RATE_ROUNDS, reference);
+}
+
+/*
+ * Walks the ladder from limit_hz down and settles on the first rate with
+ * a clean burst of reads, a limit of 0 keeps the current rate. The
+ * reference config page is read at the slowest rate, which any harness
+ * should manage. Same locking rules as the gap calibration.
+ */
+static int rcio_spi_probe_rates(struct rcio_adapter *state, u32 limit_hz)
+{
+    rcio_spi_reference_t reference;
+    u32 settled_hz = spi_clock.dt_hz;
+    int ret = -EIO;
+
+    if (limit_hz == 0) {
+        return 0;
+    }
+
+    trial.gap_us = timing.gap_us;
+    trial.speed_hz = rcio_spi_rates[ARRAY_SIZE(rcio_spi_rates) - 1];
+
+    if (rcio_spi_read_reference(state, reference) < 0) {
+        dev_warn(state->dev, "rcio_spi: no reply at the slowest clock, keeping %u Hz\n", spi_clock.dt_hz);
+        goto out;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(rcio_spi_rates); i++) {
+        if (rcio_spi_rates[i] > limit_hz) {
+            continue;
+        }
+
+        if (rcio_spi_rate_works(state, rcio_spi_rates[i], reference)) {
+            settled_hz = rcio_spi_rates[i];
+            ret = 0;
+            break;
+        }
+    }
+
+    if (ret < 0) {
+        dev_warn(state->dev, "rcio_spi: no clock rate passed, keeping %u Hz\n", spi_clock.dt_hz);
+    }
+
+out:
+    rcio_spi_trial_lock(state);
+    if (rcio_spi_set_speed(state, settled_hz) < 0) {
+        ret = -EIO;
+    }
+    rcio_spi_trial_unlock(state);
+
+    return ret;
+}
+
+static int rcio_spi_board_type(struct rcio_adapter *state)
+{
+    u16 reg;
+
+    if (__rcio_spi_read(state, (PX4IO_PAGE_STATUS << 8) | PX4IO_P_STATUS_BOARD_TYPE, (char *)&reg, 1) != 1) {
+        return -EIO;
+    }
+
+    return reg < UNKNOWN_BOARD ? reg : -ENODEV;
+}
+
+static void rcio_spi_setup_gap(struct rcio_adapter *state)
+{
+    int board = rcio_spi_board_type(state);
+
+    if (board >= 0 && gap_us[board] != 0) {
+        timing.gap_us = clamp(gap_us[board], (unsigned int)RCIO_SPI_MIN_GAP_US, (unsigned int)RCIO_SPI_MAX_GAP_US);
+        dev_info(state->dev, "rcio_spi: gap set to %u us for board type %d\n", timing.gap_us, board);
+        return;
+    }
+
+    /* the calibrated value is what goes into gap_us to skip this next time */
+    if (rcio_spi_calibrate(state) == 0) {
+        dev_info(state->dev, "rcio_spi: board type %d replies after %u us, using a %u us gap\n",
+                board, timing.calibrated_us, timing.gap_us);
+    }
+}
+
 struct rcio_adapter st;
 
+static ssize_t gap_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(timing.gap_us));
+}
+
+static ssize_t gap_us_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int value;
+    int ret = 0;
+
+    if (kstrtouint(buf, 10, &value) < 0 || (value != 0 && (value < RCIO_SPI_MIN_GAP_US || value > RCIO_SPI_MAX_GAP_US))) {
+        dev_err(st.dev, "rcio_spi: Invalid value for gap_us, this should be 0 to calibrate or from %d to %d\n",
+                RCIO_SPI_MIN_GAP_US, RCIO_SPI_MAX_GAP_US);
+        return -EINVAL;
+    }
+
+    /* the trial packets never hold off PWM for more than one packet, but they still eat its bus time */
+    if (value == 0 && rcio_pwm_armed()) {
+        dev_err(st.dev, "rcio_spi: gap_us can not be calibrated while PWM is armed\n");
+        return -EBUSY;
+    }
+
+    mutex_lock(&trial.lock);
+
+    if (value == 0) {
+        ret = rcio_spi_calibrate(&st);
+    } else {
+        rcio_spi_trial_lock(&st);
+        timing.gap_us = value;
+        rcio_spi_trial_unlock(&st);
+    }
+
+    mutex_unlock(&trial.lock);
+
+    return ret < 0 ? ret : count;
+}
+
+static ssize_t calibrated_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(timing.calibrated_us));
+}
+
+static ssize_t gap_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "transactions: %u\ncrc_errors: %u\nstale_replies: %u\nwidened: %u\n",
+            READ_ONCE(timing.transactions), READ_ONCE(timing.crc_errors), READ_ONCE(timing.stale_replies),
+            READ_ONCE(timing.widened));
+}
+
+static ssize_t speed_hz_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(spi_clock.speed_hz));
+}
+
+static ssize_t speed_hz_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int value;
+    int ret;
+
+    if (kstrtouint(buf, 10, &value) < 0 || (value != 0 && (value < rcio_spi_rates[ARRAY_SIZE(rcio_spi_rates) - 1] ||
+            value > rcio_spi_rates[0]))) {
+        dev_err(st.dev, "rcio_spi: Invalid value for speed_hz, this should be 0 to probe or from %u to %u\n",
+                rcio_spi_rates[ARRAY_SIZE(rcio_spi_rates) - 1], rcio_spi_rates[0]);
+        return -EINVAL;
+    }
+
+    /* same as for the gap calibration, and the ladder takes even more bus time */
+    if (value == 0 && rcio_pwm_armed()) {
+        dev_err(st.dev, "rcio_spi: speed_hz can not be probed while PWM is armed\n");
+        return -EBUSY;
+    }
+
+    mutex_lock(&trial.lock);
+
+    if (value == 0) {
+        /* asked for explicitly, so the whole ladder is fair game unless the module limits it */
+        ret = rcio_spi_probe_rates(&st, max_speed_hz ? max_speed_hz : rcio_spi_rates[0]);
+    } else {
+        rcio_spi_trial_lock(&st);
+        ret = rcio_spi_set_speed(&st, value);
+        rcio_spi_trial_unlock(&st);
+    }
+
+    mutex_unlock(&trial.lock);
+
+    return ret < 0 ? ret : count;
+}
+
+static ssize_t speed_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "dt_hz: %u\nstep_downs: %u\n", spi_clock.dt_hz, READ_ONCE(spi_clock.step_downs));
+}
+
+static struct kobj_attribute gap_us_attribute = __ATTR_RW(gap_us);
+static struct kobj_attribute calibrated_us_attribute = __ATTR_RO(calibrated_us);
+static struct kobj_attribute gap_stats_attribute = __ATTR_RO(gap_stats);
+static struct kobj_attribute speed_hz_attribute = __ATTR_RW(speed_hz);
+static struct kobj_attribute speed_stats_attribute = __ATTR_RO(speed_stats);
+
+static struct attribute *attrs[] = {
+    &gap_us_attribute.attr,
+    &calibrated_us_attribute.attr,
+    &gap_stats_attribute.attr,
+    &speed_hz_attribute.attr,
+    &speed_stats_attribute.attr,
+    NULL,
+};
+
+static struct attribute_group attr_group = {
+    .name = "rcio",
+    .attrs = attrs,
+};
+
 static int rcio_spi_probe(struct spi_device *spi)
 {
     int ret;
@@ -145,6 +801,7 @@ static int rcio_spi_probe(struct spi_device *spi)
     st.dev = &spi->dev;
     st.write = rcio_spi_write;
     st.read = rcio_spi_read;
+    st.transfer = rcio_spi_transfer;
 
     buffer = kmalloc(sizeof(struct IOPacket), GFP_DMA | GFP_KERNEL);
 
@@ -152,6 +809,19 @@ static int rcio_spi_probe(struct spi_device *spi)
         printk(KERN_INFO "No memory\n");
         return -ENOMEM;
     }
+
+    /* nobody else has the adapter yet, so no lock */
+    spi_clock.dt_hz = spi->max_speed_hz;
+    spi_clock.speed_hz = spi_clock.dt_hz;
+    spi_clock.rung = rcio_spi_rung(spi_clock.dt_hz);
+    mutex_init(&trial.lock);
+    trial.shared = false;
+
+    if (rcio_spi_probe_rates(&st, max_speed_hz) == 0 && max_speed_hz != 0) {
+        dev_info(&spi->dev, "rcio_spi: clock at %u Hz (device tree %u Hz)\n", spi_clock.speed_hz, spi_clock.dt_hz);
+    }
+
+    rcio_spi_setup_gap(&st);
     
     ret = rcio_probe(&st);
         if (ret < 0) {
@@ -159,12 +829,24 @@ static int rcio_spi_probe(struct spi_device *spi)
         return ret;
     }
 
+    /* from here on the core's loops share the adapter, see rcio_spi_trial */
+    trial.shared = true;
+
+    if (sysfs_create_group(&spi->dev.kobj, &attr_group) < 0) {
+        dev_warn(&spi->dev, "rcio_spi: timing attributes not registered in sysfs\n");
+    }
+
     return 0;
 }
 
 static int rcio_spi_remove(struct spi_device *spi)
 {
-    int ret = rcio_remove(&st);
+    int ret;
+
+    sysfs_remove_group(&spi->dev.kobj, &attr_group);
+    trial.shared = false;
+
+    ret = rcio_remove(&st);
 
     if (ret < 0) {
         dev_err(&spi->dev, "rcio_remove=%d", ret);
@@ -0,0 +1,385 @@
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#define DEBUG
+#include <linux/device.h>
+
+#include "rcio.h"
+#include "rcio_debug.h"
+#include "rcio_idle.h"
+#include "rcio_stats.h"
+
+#define rcio_stats_err(__dev, format, args...)\
+        dev_err(__dev, "rcio_stats: " format, ##args)
+
+#define RCIO_STATS_MIN_BUDGET_US 100
+#define RCIO_STATS_MAX_BUDGET_US 100000
+
+static const char *loop_names[RCIO_LOOPS] = {
+    [RCIO_LOOP_FAST] = "fast",
+    [RCIO_LOOP_SLOW] = "slow",
+};
+
+static const char *subsystem_names[RCIO_SUBSYSTEMS] = {
+    [RCIO_SUBSYSTEM_STATUS_FETCH] = "status_fetch",
+    [RCIO_SUBSYSTEM_LINK] = "link",
+    [RCIO_SUBSYSTEM_PWM] = "pwm",
+    [RCIO_SUBSYSTEM_RCIN] = "rcin",
+    [RCIO_SUBSYSTEM_SAFETY] = "safety",
+    [RCIO_SUBSYSTEM_ADC] = "adc",
+    [RCIO_SUBSYSTEM_GPIO] = "gpio",
+    [RCIO_SUBSYSTEM_STATUS] = "status",
+    [RCIO_SUBSYSTEM_HEALTH] = "health",
+};
+
+struct rcio_loop_stats {
+    unsigned int budget_us;
+    u64 start_ns;
+    /* when the loop should be back from its sleep, 0 until it has slept once */
+    u64 wake_ns;
+
+    u64 cycles;
+    u64 overruns;
+    u64 total_cycle_ns;
+    u64 max_cycle_ns;
+    u64 total_late_ns;
+    u64 max_late_ns;
+    u64 cycle_histogram[RCIO_DEBUG_BUCKETS];
+    u64 late_histogram[RCIO_DEBUG_BUCKETS];
+};
+
+struct rcio_subsystem_stats {
+    u64 count;
+    u64 total_ns;
+    u64 max_ns;
+    u64 histogram[RCIO_DEBUG_BUCKETS];
+};
+
+/*
+ * A cycle is one pass of a worker loop, from waking up to going back to
+ * sleep. Lateness is how much later than asked for the loop woke up, which
+ * is scheduling delay plus timer slack; an overrun is a cycle that took
+ * longer than the loop's budget. Each loop only ever writes its own stats,
+ * the lock is there so readers get consistent 64 bit values.
+ */
+static struct rcio_stats {
+    struct rcio_state *rcio;
+    spinlock_t lock;
+    struct rcio_loop_stats loops[RCIO_LOOPS];
+    struct rcio_subsystem_stats subsystems[RCIO_SUBSYSTEMS];
+} stats;
+
+const char *rcio_stats_subsystem_name(rcio_subsystem_t subsystem)
+{
+    return subsystem_names[subsystem];
+}
+
+void rcio_stats_cycle_start(rcio_loop_t loop)
+{
+    struct rcio_loop_stats *loop_stats = &stats.loops[loop];
+    u64 now = ktime_get_ns();
+
+    spin_lock(&stats.lock);
+
+    /* woken early by a kick counts as on time */
+    if (loop_stats->wake_ns != 0) {
+        u64 late = now > loop_stats->wake_ns ? now - loop_stats->wake_ns : 0;
+
+        loop_stats->total_late_ns += late;
+        loop_stats->max_late_ns = max(loop_stats->max_late_ns, late);
+        loop_stats->late_histogram[rcio_debug_bucket(late)]++;
+    }
+
+    loop_stats->start_ns = now;
+
+    spin_unlock(&stats.lock);
+}
+
+void rcio_stats_cycle_end(rcio_loop_t loop)
+{
+    struct rcio_loop_stats *loop_stats = &stats.loops[loop];
+    u64 now = ktime_get_ns();
+    u64 cycle;
+
+    spin_lock(&stats.lock);
+
+    cycle = now - loop_stats->start_ns;
+
+    loop_stats->cycles++;
+    loop_stats->total_cycle_ns += cycle;
+    loop_stats->max_cycle_ns = max(loop_stats->max_cycle_ns, cycle);
+    loop_stats->cycle_histogram[rcio_debug_bucket(cycle)]++;
+
+    if (cycle > (u64)loop_stats->budget_us * NSEC_PER_USEC) {
+        loop_stats->overruns++;
+    }
+
+    loop_stats->wake_ns = now + (u64)rcio_idle_sleep_us() * NSEC_PER_USEC;
+
+    spin_unlock(&stats.lock);
+}
+
+void rcio_stats_subsystem(rcio_subsystem_t subsystem, u64 ns)
+{
+    struct rcio_subsystem_stats *subsystem_stats = &stats.subsystems[subsystem];
+
+    spin_lock(&stats.lock);
+    subsystem_stats->count++;
+    subsystem_stats->total_ns += ns;
+    subsystem_stats->max_ns = max(subsystem_stats->max_ns, ns);
+    subsystem_stats->histogram[rcio_debug_bucket(ns)]++;
+    spin_unlock(&stats.lock);
+}
+
+static int loop_from_name(const char *name)
+{
+    for (int i = 0; i < RCIO_LOOPS; i++) {
+        if (!strncmp(name, loop_names[i], strlen(loop_names[i]))) {
+            return i;
+        }
+    }
+
+    return -EINVAL;
+}
+
+static ssize_t loop_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct rcio_loop_stats loop_stats;
+    int loop = loop_from_name(attr->attr.name);
+    u64 cycles;
+
+    if (loop < 0) {
+        return -EIO;
+    }
+
+    spin_lock(&stats.lock);
+    loop_stats = stats.loops[loop];
+    spin_unlock(&stats.lock);
+
+    cycles = max_t(u64, loop_stats.cycles, 1);
+
+    return sprintf(buf, "cycles: %llu\noverruns: %llu\navg_cycle_us: %llu\nmax_cycle_us: %llu\n"
+            "avg_late_us: %llu\nmax_late_us: %llu\n",
+            loop_stats.cycles, loop_stats.overruns,
+            div64_u64(loop_stats.total_cycle_ns, cycles * NSEC_PER_USEC),
+            div_u64(loop_stats.max_cycle_ns, NSEC_PER_USEC),
+            div64_u64(loop_stats.total_late_ns, cycles * NSEC_PER_USEC),
+            div_u64(loop_stats.max_late_ns, NSEC_PER_USEC));
+}
+
+static ssize_t loop_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    struct rcio_loop_stats *loop_stats;
+    int loop = loop_from_name(attr->attr.name);
+
+    if (loop < 0) {
+        return -EIO;
+    }
+
+    loop_stats = &stats.loops[loop];
+
+    spin_lock(&stats.lock);
+    loop_stats->cycles = 0;
+    loop_stats->overruns = 0;
+    loop_stats->total_cycle_ns = 0;
+    loop_stats->max_cycle_ns = 0;
+    loop_stats->total_late_ns = 0;
+    loop_stats->max_late_ns = 0;
+    memset(loop_stats->cycle_histogram, 0, sizeof(loop_stats->cycle_histogram));
+    memset(loop_stats->late_histogram, 0, sizeof(loop_stats->late_histogram));
+    spin_unlock(&stats.lock);
+
+    return count;
+}
+
+static ssize_t budget_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    int loop = loop_from_name(attr->attr.name);
+
+    if (loop < 0) {
+        return -EIO;
+    }
+
+    return sprintf(buf, "%u\n", READ_ONCE(stats.loops[loop].budget_us));
+}
+
+static ssize_t budget_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    int loop = loop_from_name(attr->attr.name);
+    unsigned int value;
+
+    if (loop < 0) {
+        return -EIO;
+    }
+
+    if (kstrtouint(buf, 10, &value) < 0 || value < RCIO_STATS_MIN_BUDGET_US || value > RCIO_STATS_MAX_BUDGET_US) {
+        rcio_stats_err(stats.rcio->adapter->dev, "Invalid value for %s, this should be from %d to %d\n",
+                attr->attr.name, RCIO_STATS_MIN_BUDGET_US, RCIO_STATS_MAX_BUDGET_US);
+        return -EINVAL;
+    }
+
+    spin_lock(&stats.lock);
+    stats.loops[loop].budget_us = value;
+    spin_unlock(&stats.lock);
+
+    return count;
+}
+
+static ssize_t subsystems_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct rcio_subsystem_stats subsystems[RCIO_SUBSYSTEMS];
+    ssize_t len;
+
+    spin_lock(&stats.lock);
+    memcpy(subsystems, stats.subsystems, sizeof(subsystems));
+    spin_unlock(&stats.lock);
+
+    len = scnprintf(buf, PAGE_SIZE, "subsystem count avg_us max_us\n");
+
+    for (int i = 0; i < RCIO_SUBSYSTEMS; i++) {
+        u64 avg = subsystems[i].count ? div64_u64(subsystems[i].total_ns, subsystems[i].count) : 0;
+
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s %llu %llu %llu\n", subsystem_names[i], subsystems[i].count,
+                div_u64(avg, NSEC_PER_USEC), div_u64(subsystems[i].max_ns, NSEC_PER_USEC));
+    }
+
+    return len;
+}
+
+static ssize_t subsystems_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    spin_lock(&stats.lock);
+    memset(stats.subsystems, 0, sizeof(stats.subsystems));
+    spin_unlock(&stats.lock);
+
+    return count;
+}
+
+static struct kobj_attribute fast_attribute = __ATTR(fast, S_IRUGO | S_IWUSR, loop_show, loop_store);
+static struct kobj_attribute slow_attribute = __ATTR(slow, S_IRUGO | S_IWUSR, loop_show, loop_store);
+static struct kobj_attribute fast_budget_us_attribute = __ATTR(fast_budget_us, S_IRUGO | S_IWUSR, budget_show, budget_store);
+static struct kobj_attribute slow_budget_us_attribute = __ATTR(slow_budget_us, S_IRUGO | S_IWUSR, budget_show, budget_store);
+static struct kobj_attribute subsystems_attribute = __ATTR_RW(subsystems);
+
+static struct attribute *attrs[] = {
+    &fast_attribute.attr,
+    &slow_attribute.attr,
+    &fast_budget_us_attribute.attr,
+    &slow_budget_us_attribute.attr,
+    &subsystems_attribute.attr,
+    NULL,
+};
+
+static struct attribute_group attr_group = {
+    .name = "stats",
+    .attrs = attrs,
+};
+
+static int histogram_show(struct seq_file *s, void *unused)
+{
+    u64 buckets[RCIO_DEBUG_BUCKETS];
+
+    spin_lock(&stats.lock);
+    memcpy(buckets, s->private, sizeof(buckets));
+    spin_unlock(&stats.lock);
+
+    rcio_debug_histogram(s, buckets);
+
+    return 0;
+}
+
+static int histogram_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, histogram_show, inode->i_private);
+}
+
+static const struct file_operations histogram_fops = {
+    .owner = THIS_MODULE,
+    .open = histogram_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int subsystem_time_show(struct seq_file *s, void *unused)
+{
+    u64 buckets[RCIO_DEBUG_BUCKETS];
+
+    for (int i = 0; i < RCIO_SUBSYSTEMS; i++) {
+        spin_lock(&stats.lock);
+        memcpy(buckets, stats.subsystems[i].histogram, sizeof(buckets));
+        spin_unlock(&stats.lock);
+
+        seq_printf(s, "%s:\n", subsystem_names[i]);
+        rcio_debug_histogram(s, buckets);
+    }
+
+    return 0;
+}
+
+static int subsystem_time_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, subsystem_time_show, inode->i_private);
+}
+
+static const struct file_operations subsystem_time_fops = {
+    .owner = THIS_MODULE,
+    .open = subsystem_time_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void rcio_stats_debugfs(void)
+{
+    struct dentry *dir = rcio_debug_dir();
+    char name[32];
+
+    if (dir == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < RCIO_LOOPS; i++) {
+        snprintf(name, sizeof(name), "%s_cycle", loop_names[i]);
+        debugfs_create_file(name, S_IRUGO, dir, stats.loops[i].cycle_histogram, &histogram_fops);
+
+        snprintf(name, sizeof(name), "%s_late", loop_names[i]);
+        debugfs_create_file(name, S_IRUGO, dir, stats.loops[i].late_histogram, &histogram_fops);
+    }
+
+    debugfs_create_file("subsystem_time", S_IRUGO, dir, NULL, &subsystem_time_fops);
+}
+
+int rcio_stats_probe(struct rcio_state *state)
+{
+    int ret;
+
+    stats.rcio = state;
+
+    spin_lock_init(&stats.lock);
+
+    /* the fast loop is meant to come around every millisecond */
+    stats.loops[RCIO_LOOP_FAST].budget_us = 1000;
+    stats.loops[RCIO_LOOP_SLOW].budget_us = 5000;
+
+    ret = sysfs_create_group(stats.rcio->object, &attr_group);
+
+    if (ret < 0) {
+        rcio_stats_err(state->adapter->dev, "module not registered int sysfs\n");
+        return ret;
+    }
+
+    rcio_stats_debugfs();
+
+    return 0;
+}
+
+EXPORT_SYMBOL_GPL(rcio_stats_probe);
+EXPORT_SYMBOL_GPL(rcio_stats_cycle_start);
+EXPORT_SYMBOL_GPL(rcio_stats_cycle_end);
+EXPORT_SYMBOL_GPL(rcio_stats_subsystem);
+EXPORT_SYMBOL_GPL(rcio_stats_subsystem_name);
+MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
+MODULE_DESCRIPTION("RCIO worker loop statistics");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,27 @@
+#ifndef _RCIO_STATS_H
+#define _RCIO_STATS_H
+
+#include "rcio.h"
+
+typedef enum {
+    RCIO_LOOP_FAST = 0, RCIO_LOOP_SLOW,
+    RCIO_LOOPS
+} rcio_loop_t;
+
+typedef enum {
+    RCIO_SUBSYSTEM_STATUS_FETCH = 0, RCIO_SUBSYSTEM_LINK, RCIO_SUBSYSTEM_PWM, RCIO_SUBSYSTEM_RCIN,
+    RCIO_SUBSYSTEM_SAFETY, RCIO_SUBSYSTEM_ADC, RCIO_SUBSYSTEM_GPIO, RCIO_SUBSYSTEM_STATUS,
+    RCIO_SUBSYSTEM_HEALTH,
+    RCIO_SUBSYSTEMS
+} rcio_subsystem_t;
+
+int rcio_stats_probe(struct rcio_state *state);
+void rcio_stats_cycle_start(rcio_loop_t loop);
+void rcio_stats_cycle_end(rcio_loop_t loop);
+void rcio_stats_subsystem(rcio_subsystem_t subsystem, u64 ns);
+const char *rcio_stats_subsystem_name(rcio_subsystem_t subsystem);
+
+/* the update the calling worker is in, RCIO_SUBSYSTEMS outside of one (rcio_core.c) */
+rcio_subsystem_t rcio_current_subsystem(void);
+
+#endif
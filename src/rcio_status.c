@@ -34,6 +34,8 @@ static struct rcio_status {
     bool init_ok;
     bool pwm_ok;
     bool alive;
+    uint16_t flags;
+    uint16_t alarms;
     board_type_t board_type;
     char git_hash[20];
     struct rcio_state *rcio;
@@ -87,32 +89,87 @@ static struct attribute_group attr_group = {
     .attrs = attrs,
 };
 
+/*
+ * Wake up poll()ers of every attribute that changed and tell udev about
+ * alive transitions, so supervisors don't have to busy-poll alive.
+ */
+static void rcio_status_notify(struct rcio_state *state, bool was_alive, bool was_init_ok, bool was_pwm_ok)
+{
+    char alive_env[16];
+    char *envp[] = { alive_env, NULL };
+
+    if (status.init_ok != was_init_ok) {
+        sysfs_notify(state->object, attr_group.name, init_ok_attribute.attr.name);
+    }
+
+    if (status.pwm_ok != was_pwm_ok) {
+        sysfs_notify(state->object, attr_group.name, pwm_ok_attribute.attr.name);
+    }
+
+    if (status.alive != was_alive) {
+        sysfs_notify(state->object, attr_group.name, alive_attribute.attr.name);
+
+        /* /sys/kernel/rcio has no kset to send uevents from, the SPI device has */
+        snprintf(alive_env, sizeof(alive_env), "RCIO_ALIVE=%d", status.alive? 1: 0);
+        kobject_uevent_env(&state->adapter->dev->kobj, KOBJ_CHANGE, envp);
+
+        if (status.alive) {
+            rcio_status_warn(state->adapter->dev, "IO is alive\n");
+        } else {
+            rcio_status_err(state->adapter->dev, "IO is not responding\n");
+        }
+    }
+}
+
 bool rcio_status_update(struct rcio_state *state)
 {
-    uint16_t regs[6];
+    struct rcio_io_status io_status;
+    bool was_alive = status.alive;
+    bool was_init_ok = status.init_ok;
+    bool was_pwm_ok = status.pwm_ok;
 
     if (time_before(jiffies, status.timeout)) {
         return false;
     }
 
-    if (state->register_get(state, PX4IO_PAGE_STATUS, PX4IO_P_STATUS_FLAGS, regs, ARRAY_SIZE(regs)) < 0) {
+    status.timeout = jiffies + HZ / 5; /* timeout in 0.2s */
+
+    if (!state->status_get(state, &io_status)) {
         status.alive = false;
+        rcio_status_notify(state, was_alive, was_init_ok, was_pwm_ok);
         return false;
     }
 
-    if (!rcio_status_request_crc(state)) {
-        rcio_status_err(state->adapter->dev, "Could not update CRC\n");
-    } 
+    /* CRC and git hash never change at runtime, reread them only after the IO comes back */
+    if (!status.alive) {
+        if (!rcio_status_request_crc(state)) {
+            rcio_status_err(state->adapter->dev, "Could not update CRC\n");
+        }
+
+        if (!rcio_status_request_git_hash(state)) {
+            rcio_status_err(state->adapter->dev, "Could not update git hash\n");
+        }
+    }
 
     status.alive = true;
+    status.flags = io_status.flags;
+    status.alarms = io_status.alarms;
 
-    handle_status(regs[0]);
-    handle_alarms(regs[1]);
+    handle_status(io_status.flags);
+    handle_alarms(io_status.alarms);
+
+    rcio_status_notify(state, was_alive, was_init_ok, was_pwm_ok);
 
-    status.timeout = jiffies + HZ / 5; /* timeout in 0.2s */
     return true;
 }
 
+bool rcio_status_read(uint16_t *flags, uint16_t *alarms)
+{
+    *flags = status.flags;
+    *alarms = status.alarms;
+    return status.alive;
+}
+
 bool rcio_status_probe(struct rcio_state *state)
 {
     int ret;
@@ -134,6 +191,7 @@ bool rcio_status_probe(struct rcio_state *state)
         rcio_status_err(state->adapter->dev, "could not read CRC\n");
     } else {
         rcio_status_warn(state->adapter->dev, "Firmware CRC: 0x%lx\n", status.crc);
+        status.alive = true;
     }
     
 	if (!rcio_status_request_board_type(state)) {
@@ -201,6 +259,7 @@ static void handle_alarms(uint16_t alarms)
 
 EXPORT_SYMBOL_GPL(rcio_status_probe);
 EXPORT_SYMBOL_GPL(rcio_status_update);
+EXPORT_SYMBOL_GPL(rcio_status_read);
 MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
 MODULE_DESCRIPTION("RCIO status driver");
 MODULE_LICENSE("GPL v2");
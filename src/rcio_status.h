@@ -5,5 +5,6 @@
 
 bool rcio_status_probe(struct rcio_state* state);
 bool rcio_status_update(struct rcio_state *state);
+bool rcio_status_read(uint16_t *flags, uint16_t *alarms);
 
 #endif
@@ -0,0 +1,433 @@
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/eventfd.h>
+#include <linux/kref.h>
+#include <linux/compat.h>
+#include <linux/version.h>
+#define DEBUG
+#include <linux/device.h>
+
+#include "rcio.h"
+#include "rcio_adc.h"
+#include "rcio_rcin.h"
+#include "rcio_safety.h"
+#include "rcio_status.h"
+#include "rcio_telemetry.h"
+#include "rcio_idle.h"
+
+#define rcio_telemetry_err(__dev, format, args...)\
+        dev_err(__dev, "rcio_telemetry: " format, ##args)
+#define rcio_telemetry_warn(__dev, format, args...)\
+        dev_warn(__dev, "rcio_telemetry: " format, ##args)
+
+/*
+ * Everything an open file or a mapping can reach lives here, refcounted,
+ * so the device can go away under them: open files and every mm that maps
+ * the page hold a reference, and the page itself is mapped with
+ * vm_insert_page() so the mapping pins it on its own as well. Once the
+ * device is removed, gone is set and readers get -ENODEV.
+ */
+struct rcio_telemetry_buffer {
+    struct kref ref;
+    spinlock_t lock;
+    wait_queue_head_t wait;
+    bool gone;
+    struct rcio_telemetry_record record;
+    struct page *page;
+    struct rcio_telemetry_page *shared;
+    struct list_head eventfd_readers;
+};
+
+static struct rcio_telemetry {
+    struct rcio_state *rcio;
+    struct rcio_telemetry_buffer *buffer;
+    atomic_t readers;
+    atomic_t mappings;
+} telemetry;
+
+struct rcio_telemetry_reader {
+    struct rcio_telemetry_buffer *buffer;
+    u64 sequence;
+    struct eventfd_ctx *eventfd;
+    struct list_head node;
+};
+
+static void rcio_telemetry_buffer_release(struct kref *ref)
+{
+    struct rcio_telemetry_buffer *buffer = container_of(ref, struct rcio_telemetry_buffer, ref);
+
+    __free_page(buffer->page);
+    kfree(buffer);
+}
+
+static void rcio_telemetry_buffer_put(struct rcio_telemetry_buffer *buffer)
+{
+    kref_put(&buffer->ref, rcio_telemetry_buffer_release);
+}
+
+static bool rcio_telemetry_has_news(struct rcio_telemetry_reader *reader)
+{
+    return READ_ONCE(reader->buffer->record.sequence) != reader->sequence || READ_ONCE(reader->buffer->gone);
+}
+
+static int rcio_telemetry_open(struct inode *inode, struct file *file)
+{
+    struct rcio_telemetry_reader *reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+
+    if (reader == NULL) {
+        return -ENOMEM;
+    }
+
+    /* misc_open() holds misc_mtx, so remove cannot run in between */
+    reader->buffer = telemetry.buffer;
+    kref_get(&reader->buffer->ref);
+
+    INIT_LIST_HEAD(&reader->node);
+    file->private_data = reader;
+
+    atomic_inc(&telemetry.readers);
+    rcio_idle_kick();
+
+    return nonseekable_open(inode, file);
+}
+
+static void rcio_telemetry_set_eventfd(struct rcio_telemetry_reader *reader, struct eventfd_ctx *eventfd)
+{
+    struct rcio_telemetry_buffer *buffer = reader->buffer;
+    struct eventfd_ctx *old;
+
+    spin_lock(&buffer->lock);
+
+    old = reader->eventfd;
+    reader->eventfd = eventfd;
+
+    if (old != NULL && eventfd == NULL) {
+        list_del(&reader->node);
+    } else if (old == NULL && eventfd != NULL) {
+        list_add_tail(&reader->node, &buffer->eventfd_readers);
+    }
+
+    spin_unlock(&buffer->lock);
+
+    if (old != NULL) {
+        eventfd_ctx_put(old);
+    }
+}
+
+static int rcio_telemetry_release(struct inode *inode, struct file *file)
+{
+    struct rcio_telemetry_reader *reader = file->private_data;
+
+    rcio_telemetry_set_eventfd(reader, NULL);
+    rcio_telemetry_buffer_put(reader->buffer);
+    kfree(reader);
+    atomic_dec(&telemetry.readers);
+    return 0;
+}
+
+static ssize_t rcio_telemetry_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct rcio_telemetry_reader *reader = file->private_data;
+    struct rcio_telemetry_buffer *buffer = reader->buffer;
+    struct rcio_telemetry_record record;
+    int ret;
+
+    if (count < sizeof(record)) {
+        return -EINVAL;
+    }
+
+    /* every reader gets each record once, block until a new one arrives */
+    if (!rcio_telemetry_has_news(reader)) {
+        if (file->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+
+        ret = wait_event_interruptible(buffer->wait, rcio_telemetry_has_news(reader));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (READ_ONCE(buffer->gone)) {
+        return -ENODEV;
+    }
+
+    spin_lock(&buffer->lock);
+    record = buffer->record;
+    spin_unlock(&buffer->lock);
+
+    if (copy_to_user(buf, &record, sizeof(record))) {
+        return -EFAULT;
+    }
+
+    reader->sequence = record.sequence;
+
+    return sizeof(record);
+}
+
+static __poll_t rcio_telemetry_poll(struct file *file, poll_table *wait)
+{
+    struct rcio_telemetry_reader *reader = file->private_data;
+
+    poll_wait(file, &reader->buffer->wait, wait);
+
+    if (READ_ONCE(reader->buffer->gone)) {
+        return EPOLLHUP | EPOLLERR;
+    }
+
+    if (rcio_telemetry_has_news(reader)) {
+        return EPOLLIN | EPOLLRDNORM;
+    }
+
+    return 0;
+}
+
+static long rcio_telemetry_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct rcio_telemetry_reader *reader = file->private_data;
+    struct eventfd_ctx *eventfd = NULL;
+    int fd;
+
+    if (cmd != RCIO_TELEMETRY_SET_EVENTFD) {
+        return -ENOTTY;
+    }
+
+    if (get_user(fd, (int __user *)arg)) {
+        return -EFAULT;
+    }
+
+    if (fd >= 0) {
+        eventfd = eventfd_ctx_fdget(fd);
+        if (IS_ERR(eventfd)) {
+            return PTR_ERR(eventfd);
+        }
+    }
+
+    rcio_telemetry_set_eventfd(reader, eventfd);
+
+    return 0;
+}
+
+/* forks and splits copy the vma, every copy holds its own reference */
+static void rcio_telemetry_vm_open(struct vm_area_struct *vma)
+{
+    struct rcio_telemetry_buffer *buffer = vma->vm_private_data;
+
+    kref_get(&buffer->ref);
+    atomic_inc(&telemetry.mappings);
+}
+
+static void rcio_telemetry_vm_close(struct vm_area_struct *vma)
+{
+    atomic_dec(&telemetry.mappings);
+    rcio_telemetry_buffer_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct rcio_telemetry_vm_ops = {
+    .open = rcio_telemetry_vm_open,
+    .close = rcio_telemetry_vm_close,
+};
+
+static int rcio_telemetry_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct rcio_telemetry_reader *reader = file->private_data;
+    int ret;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE) {
+        return -EINVAL;
+    }
+
+    /* the page is shared by every reader, nobody may write to it */
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0))
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    /* takes a reference on the page for as long as it is mapped */
+    ret = vm_insert_page(vma, vma->vm_start, reader->buffer->page);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    vma->vm_private_data = reader->buffer;
+    vma->vm_ops = &rcio_telemetry_vm_ops;
+    rcio_telemetry_vm_open(vma);
+
+    return 0;
+}
+
+/* the argument is a pointer, so 32-bit callers only need it widened */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0)) && defined(CONFIG_COMPAT)
+static long rcio_telemetry_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    return rcio_telemetry_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+static const struct file_operations rcio_telemetry_fops = {
+    .owner = THIS_MODULE,
+    .open = rcio_telemetry_open,
+    .release = rcio_telemetry_release,
+    .read = rcio_telemetry_read,
+    .poll = rcio_telemetry_poll,
+    .unlocked_ioctl = rcio_telemetry_ioctl,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0))
+    .compat_ioctl = compat_ptr_ioctl,
+#elif defined(CONFIG_COMPAT)
+    .compat_ioctl = rcio_telemetry_compat_ioctl,
+#endif
+    .mmap = rcio_telemetry_mmap,
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6,12,0))
+    .llseek = no_llseek,
+#endif
+};
+
+static struct miscdevice rcio_telemetry_device = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "rcio",
+    .fops = &rcio_telemetry_fops,
+    .mode = S_IRUGO,
+};
+
+static void rcio_telemetry_signal(struct eventfd_ctx *eventfd)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0))
+    eventfd_signal(eventfd);
+#else
+    eventfd_signal(eventfd, 1);
+#endif
+}
+
+/*
+ * an open /dev/rcio keeps the worker loops at full rate, and so does a
+ * mapping of the shared page that outlived the close() of its fd
+ */
+bool rcio_telemetry_has_readers(void)
+{
+    return atomic_read(&telemetry.readers) > 0 || atomic_read(&telemetry.mappings) > 0;
+}
+
+void rcio_telemetry_publish(struct rcio_state *state)
+{
+    struct rcio_telemetry_buffer *buffer = telemetry.buffer;
+    struct rcio_telemetry_reader *reader;
+    struct rcio_telemetry_record record = {
+        .version = RCIO_TELEMETRY_VERSION,
+        .size = sizeof(struct rcio_telemetry_record),
+    };
+
+    /*
+     * both worker threads publish, so the snapshot is taken under the lock
+     * too, or an older one from the slow loop could land after a newer one
+     * and the record would run backwards; the reads are plain copies
+     */
+    spin_lock(&buffer->lock);
+
+    if (rcio_status_read(&record.status_flags, &record.status_alarms)) {
+        record.flags |= RCIO_TELEMETRY_FLAG_IO_ALIVE;
+    }
+
+    if (rcio_rcin_read(record.rc)) {
+        record.flags |= RCIO_TELEMETRY_FLAG_RC_CONNECTED;
+    }
+
+    rcio_adc_read(record.adc, record.adc_filtered);
+
+    record.heartbeat = rcio_safety_read_heartbeat();
+    record.link_transfers = atomic_read(&state->transfers);
+    record.link_errors = atomic_read(&state->transfer_errors);
+    record.timestamp_ns = ktime_get_ns();
+    record.sequence = buffer->record.sequence + 1;
+    buffer->record = record;
+
+    /* seqcount-style update of the mmap()ed page, see rcio_telemetry.h */
+    WRITE_ONCE(buffer->shared->sequence, buffer->shared->sequence + 1);
+    smp_wmb();
+    buffer->shared->record = record;
+    smp_wmb();
+    WRITE_ONCE(buffer->shared->sequence, buffer->shared->sequence + 1);
+
+    list_for_each_entry(reader, &buffer->eventfd_readers, node) {
+        rcio_telemetry_signal(reader->eventfd);
+    }
+    spin_unlock(&buffer->lock);
+
+    wake_up_interruptible(&buffer->wait);
+}
+
+int rcio_telemetry_probe(struct rcio_state *state)
+{
+    int ret;
+
+    telemetry.rcio = state;
+
+    atomic_set(&telemetry.readers, 0);
+    atomic_set(&telemetry.mappings, 0);
+
+    telemetry.buffer = kzalloc(sizeof(*telemetry.buffer), GFP_KERNEL);
+
+    if (telemetry.buffer == NULL) {
+        return -ENOMEM;
+    }
+
+    telemetry.buffer->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+
+    if (telemetry.buffer->page == NULL) {
+        kfree(telemetry.buffer);
+        return -ENOMEM;
+    }
+
+    kref_init(&telemetry.buffer->ref);
+    spin_lock_init(&telemetry.buffer->lock);
+    init_waitqueue_head(&telemetry.buffer->wait);
+    INIT_LIST_HEAD(&telemetry.buffer->eventfd_readers);
+    telemetry.buffer->shared = page_address(telemetry.buffer->page);
+
+    rcio_telemetry_device.parent = state->adapter->dev;
+
+    ret = misc_register(&rcio_telemetry_device);
+
+    if (ret < 0) {
+        rcio_telemetry_err(state->adapter->dev, "could not register /dev/%s\n", rcio_telemetry_device.name);
+        rcio_telemetry_buffer_put(telemetry.buffer);
+        return ret;
+    }
+
+    return 0;
+}
+
+int rcio_telemetry_remove(struct rcio_state *state)
+{
+    struct rcio_telemetry_buffer *buffer = telemetry.buffer;
+
+    /* no new openers after this, the ones still around see the device gone */
+    misc_deregister(&rcio_telemetry_device);
+
+    WRITE_ONCE(buffer->gone, true);
+    wake_up_interruptible(&buffer->wait);
+
+    telemetry.buffer = NULL;
+    rcio_telemetry_buffer_put(buffer);
+
+    return 0;
+}
+
+EXPORT_SYMBOL_GPL(rcio_telemetry_probe);
+EXPORT_SYMBOL_GPL(rcio_telemetry_publish);
+EXPORT_SYMBOL_GPL(rcio_telemetry_remove);
+EXPORT_SYMBOL_GPL(rcio_telemetry_has_readers);
+MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
+MODULE_DESCRIPTION("RCIO telemetry device");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,67 @@
+#ifndef _RCIO_TELEMETRY_H
+#define _RCIO_TELEMETRY_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Binary record returned by read() on /dev/rcio. Userspace should check
+ * version and size before using the rest of the fields.
+ */
+
+#define RCIO_TELEMETRY_VERSION 2
+
+#define RCIO_TELEMETRY_RC_CHANNELS 16
+#define RCIO_TELEMETRY_ADC_CHANNELS 8
+
+#define RCIO_TELEMETRY_FLAG_IO_ALIVE        (1 << 0)
+#define RCIO_TELEMETRY_FLAG_RC_CONNECTED    (1 << 1)
+
+struct rcio_telemetry_record {
+    __u16 version;
+    __u16 size;
+    __u32 flags;                /* RCIO_TELEMETRY_FLAG_* */
+    __u64 sequence;             /* incremented on every published record */
+    __u64 timestamp_ns;         /* CLOCK_MONOTONIC */
+    __u16 rc[RCIO_TELEMETRY_RC_CHANNELS];
+    __u16 adc[RCIO_TELEMETRY_ADC_CHANNELS];
+    __u16 adc_filtered[RCIO_TELEMETRY_ADC_CHANNELS];
+    __u16 status_flags;         /* PX4IO_P_STATUS_FLAGS */
+    __u16 status_alarms;        /* PX4IO_P_STATUS_ALARMS */
+    __u16 heartbeat;            /* last heartbeat value sent to IO */
+    __u16 reserved;
+    __u32 link_transfers;       /* register transactions since probe */
+    __u32 link_errors;          /* failed register transactions since probe */
+};
+
+/*
+ * Read-only page returned by mmap() on /dev/rcio. The kernel makes
+ * sequence odd while it updates the record, so a consistent snapshot is
+ *
+ *     do {
+ *         seq = page->sequence;         (then a read barrier)
+ *         copy = page->record;          (then a read barrier)
+ *     } while ((seq & 1) || seq != page->sequence);
+ */
+struct rcio_telemetry_page {
+    __u32 sequence;
+    __u32 reserved;
+    struct rcio_telemetry_record record;
+};
+
+/* signal an eventfd on every published record, -1 to stop */
+#define RCIO_TELEMETRY_IOC_MAGIC 'r'
+#define RCIO_TELEMETRY_SET_EVENTFD _IOW(RCIO_TELEMETRY_IOC_MAGIC, 1, int)
+
+#ifdef __KERNEL__
+
+#include "rcio.h"
+
+int rcio_telemetry_probe(struct rcio_state *state);
+void rcio_telemetry_publish(struct rcio_state *state);
+int rcio_telemetry_remove(struct rcio_state *state);
+bool rcio_telemetry_has_readers(void);
+
+#endif
+
+#endif
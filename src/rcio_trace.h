@@ -0,0 +1,164 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rcio
+
+#if !defined(_RCIO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RCIO_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+#ifndef rcio_assign_str
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,10,0))
+#define rcio_assign_str(dst, src) __assign_str(dst)
+#else
+#define rcio_assign_str(dst, src) __assign_str(dst, src)
+#endif
+#endif
+
+/*
+ * A register access as the subsystems see it: wait_ns is the time spent
+ * in the bus arbiter, bus_ns everything from getting the bus to giving it
+ * back, including waiting for the adapter lock.
+ */
+TRACE_EVENT(rcio_register,
+
+    TP_PROTO(u8 page, u8 offset, u8 count, bool write, int class, u64 wait_ns, u64 bus_ns, int ret),
+
+    TP_ARGS(page, offset, count, write, class, wait_ns, bus_ns, ret),
+
+    TP_STRUCT__entry(
+        __field(u8, page)
+        __field(u8, offset)
+        __field(u8, count)
+        __field(bool, write)
+        __field(int, class)
+        __field(u64, wait_ns)
+        __field(u64, bus_ns)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->page = page;
+        __entry->offset = offset;
+        __entry->count = count;
+        __entry->write = write;
+        __entry->class = class;
+        __entry->wait_ns = wait_ns;
+        __entry->bus_ns = bus_ns;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%s page=%u offset=%u count=%u class=%d wait_ns=%llu bus_ns=%llu ret=%d",
+        __entry->write ? "write" : "read", __entry->page, __entry->offset, __entry->count,
+        __entry->class, __entry->wait_ns, __entry->bus_ns, __entry->ret)
+);
+
+/*
+ * A single packet on the wire: lock_wait_ns is the wait for the adapter
+ * lock (0 for all but the first packet of a batch), bus_ns covers both
+ * phases and their gaps. crc is 1 when the reply checked out, 0 when it
+ * did not and -1 when no reply came back at all.
+ */
+TRACE_EVENT(rcio_spi_xfer,
+
+    TP_PROTO(u8 page, u8 offset, u8 count, bool write, u64 lock_wait_ns, u64 bus_ns, int crc, int ret),
+
+    TP_ARGS(page, offset, count, write, lock_wait_ns, bus_ns, crc, ret),
+
+    TP_STRUCT__entry(
+        __field(u8, page)
+        __field(u8, offset)
+        __field(u8, count)
+        __field(bool, write)
+        __field(u64, lock_wait_ns)
+        __field(u64, bus_ns)
+        __field(int, crc)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->page = page;
+        __entry->offset = offset;
+        __entry->count = count;
+        __entry->write = write;
+        __entry->lock_wait_ns = lock_wait_ns;
+        __entry->bus_ns = bus_ns;
+        __entry->crc = crc;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%s page=%u offset=%u count=%u lock_wait_ns=%llu bus_ns=%llu crc=%d ret=%d",
+        __entry->write ? "write" : "read", __entry->page, __entry->offset, __entry->count,
+        __entry->lock_wait_ns, __entry->bus_ns, __entry->crc, __entry->ret)
+);
+
+DECLARE_EVENT_CLASS(rcio_cycle,
+
+    TP_PROTO(const char *loop),
+
+    TP_ARGS(loop),
+
+    TP_STRUCT__entry(
+        __string(loop, loop)
+    ),
+
+    TP_fast_assign(
+        rcio_assign_str(loop, loop);
+    ),
+
+    TP_printk("%s", __get_str(loop))
+);
+
+DEFINE_EVENT(rcio_cycle, rcio_cycle_start,
+    TP_PROTO(const char *loop),
+    TP_ARGS(loop)
+);
+
+DEFINE_EVENT(rcio_cycle, rcio_cycle_end,
+    TP_PROTO(const char *loop),
+    TP_ARGS(loop)
+);
+
+TRACE_EVENT(rcio_update_enter,
+
+    TP_PROTO(const char *subsystem),
+
+    TP_ARGS(subsystem),
+
+    TP_STRUCT__entry(
+        __string(subsystem, subsystem)
+    ),
+
+    TP_fast_assign(
+        rcio_assign_str(subsystem, subsystem);
+    ),
+
+    TP_printk("%s", __get_str(subsystem))
+);
+
+TRACE_EVENT(rcio_update_exit,
+
+    TP_PROTO(const char *subsystem, bool updated),
+
+    TP_ARGS(subsystem, updated),
+
+    TP_STRUCT__entry(
+        __string(subsystem, subsystem)
+        __field(bool, updated)
+    ),
+
+    TP_fast_assign(
+        rcio_assign_str(subsystem, subsystem);
+        __entry->updated = updated;
+    ),
+
+    TP_printk("%s updated=%d", __get_str(subsystem), __entry->updated)
+);
+
+#endif /* _RCIO_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rcio_trace
+#include <trace/define_trace.h>